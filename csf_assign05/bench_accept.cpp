@@ -0,0 +1,140 @@
+// Connection storm benchmark, in accepted connections per second. Runs
+// ./server in event-loop mode with 1, 2, 4, ... acceptors (-a) and has
+// client threads connect, log in as a sender, wait for the ok and hang
+// up, as fast as they can. Clients close with a reset so their side
+// doesn't fill up with TIME_WAIT sockets.
+//
+// Only interesting with several cores: the acceptors (and the event
+// loops, one per core) need somewhere to run in parallel.
+//
+// Usage: ./bench_accept [seconds] [client threads] [port]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace {
+
+struct BenchState {
+  int port;
+  std::atomic<bool> stop;
+  std::atomic<long> done;
+  std::atomic<long> failed;
+};
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool one_connection(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  static const char login[] = "slogin:storm\n";
+  char buf[64];
+  bool ok = connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0
+         && write(fd, login, sizeof(login) - 1) == ssize_t(sizeof(login) - 1)
+         && read(fd, buf, sizeof(buf)) > 0; // the reply needs the accept
+
+  struct linger lg = { 1, 0 }; // reset rather than TIME_WAIT
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  close(fd);
+  return ok;
+}
+
+void *client(void *arg) {
+  BenchState *st = static_cast<BenchState *>(arg);
+  while (!st->stop.load(std::memory_order_relaxed)) {
+    if (one_connection(st->port)) {
+      st->done++;
+    } else {
+      st->failed++;
+    }
+  }
+  return nullptr;
+}
+
+pid_t start_server(int port, int acceptors, int loops) {
+  std::cout.flush(); // or the child's exit writes it out again
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::string p = std::to_string(port), a = std::to_string(acceptors),
+                e = std::to_string(loops);
+    if (!freopen("/dev/null", "w", stdout)) {
+      _exit(127);
+    }
+    execl("./server", "server", "-e", e.c_str(), "-a", a.c_str(), p.c_str(), (char *) nullptr);
+    _exit(127);
+  }
+  usleep(200000); // let it get to its accept loop
+  return pid;
+}
+
+}
+
+int main(int argc, char **argv) {
+  double secs = (argc > 1) ? std::stod(argv[1]) : 2.0;
+  int nclients = (argc > 2) ? std::stoi(argv[2]) : 8;
+  int port = (argc > 3) ? std::stoi(argv[3]) : 47500;
+  int cores = int(sysconf(_SC_NPROCESSORS_ONLN));
+
+  std::cout << "acceptors   conn/s      (" << nclients << " clients, "
+            << cores << " event loops)\n";
+  for (int acceptors = 1; acceptors <= std::max(cores, 4); acceptors *= 2) {
+    pid_t server = start_server(port, acceptors, cores);
+
+    BenchState st;
+    st.port = port;
+    st.stop = false;
+    st.done = 0;
+    st.failed = 0;
+
+    std::vector<pthread_t> tids(nclients);
+    double start = now_sec();
+    for (pthread_t &t : tids) {
+      pthread_create(&t, nullptr, client, &st);
+    }
+    usleep(useconds_t(secs * 1e6));
+    st.stop = true;
+    for (pthread_t t : tids) {
+      pthread_join(t, nullptr);
+    }
+    double t = now_sec() - start;
+
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+
+    std::cout << std::setw(9) << acceptors << std::fixed << std::setprecision(0)
+              << std::setw(10) << st.done / t;
+    if (st.failed > 0) {
+      std::cout << "  (" << st.failed << " failed)";
+    }
+    std::cout << "\n";
+    port++; // don't wait for the old listeners to go away
+  }
+  return 0;
+}
@@ -0,0 +1,80 @@
+// Microbenchmark for decoding inbound lines: the old receive path
+// (copy out of the read buffer, build a std::string, substr the tag
+// and data, pop the newline) against decoding a MessageView in place.
+//
+// Usage: ./bench_decode [iterations]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <ctime>
+#include "message.h"
+
+namespace {
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// what Connection::receive and Message::decode used to do per line
+bool legacy_decode(const char *line, size_t len, Message &msg) {
+  char buf[Message::MAX_LEN + 1];
+  memcpy(buf, line, len);
+  buf[len] = '\0';
+  std::string raw(buf);
+
+  size_t sep = raw.find(':');
+  if (sep == std::string::npos) {
+    return false;
+  }
+  msg.tag = raw.substr(0, sep);
+  msg.data = raw.substr(sep + 1);
+  while (!msg.data.empty() && (msg.data.back() == '\n' || msg.data.back() == '\r')) {
+    msg.data.pop_back();
+  }
+  return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+  long iters = (argc > 1) ? std::stol(argv[1]) : 2000000;
+
+  std::vector<std::string> lines = {
+    "sendall:hi\n",
+    "join:partytime\n",
+    "sendall:Sending a gratuitously long message to try trigger problems in the "
+      "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa server 17\n",
+  };
+
+  std::cout << "line bytes  legacy ns/line  view ns/line\n";
+  for (const std::string &line : lines) {
+    size_t sink = 0;
+
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+      Message msg;
+      legacy_decode(line.data(), line.size(), msg);
+      sink += msg.data.size();
+    }
+    double legacy = now_sec() - start;
+
+    start = now_sec();
+    for (long i = 0; i < iters; i++) {
+      MessageView view;
+      view.decode(line.data(), line.size());
+      sink += view.data_len;
+    }
+    double view = now_sec() - start;
+
+    std::cout << std::setw(10) << line.size() << "  " << std::fixed << std::setprecision(1)
+              << std::setw(14) << legacy * 1e9 / iters << "  " << std::setw(12) << view * 1e9 / iters
+              << (sink ? "" : " ") << "\n";
+  }
+
+  return 0;
+}
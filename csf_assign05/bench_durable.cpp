@@ -0,0 +1,229 @@
+// Benchmark for the history durability settings (-f): acknowledged
+// sendalls per second and the 50th/99th percentile time from sending
+// one to getting its OK. Runs ./server with a scratch history
+// directory for each setting, in threaded and event-loop mode, with
+// sender threads spread over a few rooms, each keeping up to [window]
+// sendalls in flight (1 is a sender that waits for every OK).
+//
+// The numbers depend almost entirely on how long fdatasync takes on
+// the disk under /tmp.
+//
+// Usage: ./bench_durable [seconds] [senders] [window] [port]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace {
+
+const int SENDERS_PER_ROOM = 4;
+
+struct SenderArgs {
+  int port;
+  int id;
+  int window;
+  std::atomic<bool> *stop;
+  std::vector<double> latencies; // seconds, one per OK
+  bool failed;
+};
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connect_to(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+bool send_all(int fd, const std::string &s) {
+  return write(fd, s.data(), s.size()) == ssize_t(s.size());
+}
+
+void *sender(void *arg) {
+  SenderArgs *a = static_cast<SenderArgs *>(arg);
+  a->failed = true;
+  int fd = connect_to(a->port);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  std::string login = "slogin:sender" + std::to_string(a->id) + "\n"
+                    + "join:room" + std::to_string(a->id / SENDERS_PER_ROOM) + "\n";
+  const std::string msg = "sendall:a message of some ordinary length, about sixty bytes\n";
+  char buf[4096];
+  int skip = 2; // the login and join replies
+
+  std::deque<double> sent; // when each OK we're owed was asked for
+  bool ok = send_all(fd, login);
+  while (ok && !a->stop->load(std::memory_order_relaxed)) {
+    std::string batch;
+    while (int(sent.size()) < a->window) {
+      batch += msg;
+      sent.push_back(now_sec());
+    }
+    if (!batch.empty() && !send_all(fd, batch)) {
+      break;
+    }
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      ok = false;
+      break;
+    }
+    double now = now_sec();
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i] != '\n') {
+        continue;
+      }
+      if (skip > 0) {
+        skip--;
+      } else if (!sent.empty()) {
+        a->latencies.push_back(now - sent.front());
+        sent.pop_front();
+      }
+    }
+  }
+  close(fd);
+  a->failed = !ok;
+  return nullptr;
+}
+
+pid_t start_server(int port, const std::string &dir, const std::vector<std::string> &args) {
+  std::cout.flush(); // or the child's exit writes it out again
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::vector<const char *> argv = { "server", "-D", dir.c_str() };
+    for (const std::string &arg : args) {
+      argv.push_back(arg.c_str());
+    }
+    std::string p = std::to_string(port);
+    argv.push_back(p.c_str());
+    argv.push_back(nullptr);
+    if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) {
+      _exit(127);
+    }
+    execv("./server", const_cast<char *const *>(argv.data()));
+    _exit(127);
+  }
+  usleep(200000); // let it get to its accept loop
+  return pid;
+}
+
+}
+
+int main(int argc, char **argv) {
+  double secs = (argc > 1) ? std::stod(argv[1]) : 2.0;
+  int nsenders = (argc > 2) ? std::stoi(argv[2]) : 16;
+  int window = (argc > 3) ? std::stoi(argv[3]) : 1;
+  int port = (argc > 4) ? std::stoi(argv[4]) : 47600;
+
+  struct Setting {
+    const char *name;
+    std::vector<std::string> args;
+  };
+  const Setting settings[] = {
+    { "none",        { "-f", "none" } },
+    { "each",        { "-f", "each" } },
+    { "group 0ms",   { "-f", "group", "-F", "0" } },
+    { "group 1ms",   { "-f", "group", "-F", "1" } },
+    { "group 5ms",   { "-f", "group", "-F", "5" } },
+  };
+  const char *modes[] = { "threads", "epoll" };
+
+  std::cout << nsenders << " senders, " << SENDERS_PER_ROOM << " per room, window "
+            << window << "\n"
+            << "setting     mode        acked/s    p50 ms    p99 ms\n";
+  for (const Setting &setting : settings) {
+    for (int m = 0; m < 2; m++) {
+      char dir[] = "/tmp/bench_durable.XXXXXX";
+      if (!mkdtemp(dir)) {
+        std::cerr << "can't make a scratch directory\n";
+        return 1;
+      }
+      std::vector<std::string> args = setting.args;
+      if (m == 1) {
+        args.push_back("-e");
+        args.push_back("2");
+      }
+      pid_t server = start_server(port, dir, args);
+
+      std::atomic<bool> stop(false);
+      std::vector<SenderArgs> senders(nsenders);
+      std::vector<pthread_t> tids(nsenders);
+      for (int i = 0; i < nsenders; i++) {
+        senders[i].port = port;
+        senders[i].id = i;
+        senders[i].window = window;
+        senders[i].stop = &stop;
+        pthread_create(&tids[i], nullptr, sender, &senders[i]);
+      }
+      double start = now_sec();
+      usleep(useconds_t(secs * 1e6));
+      stop = true;
+      for (pthread_t t : tids) {
+        pthread_join(t, nullptr);
+      }
+      double t = now_sec() - start;
+
+      kill(server, SIGTERM);
+      waitpid(server, nullptr, 0);
+      std::string rm = std::string("rm -rf ") + dir;
+      if (system(rm.c_str()) != 0) {
+        std::cerr << "couldn't remove " << dir << "\n";
+      }
+
+      std::vector<double> all;
+      int failed = 0;
+      for (SenderArgs &a : senders) {
+        all.insert(all.end(), a.latencies.begin(), a.latencies.end());
+        failed += a.failed;
+      }
+      std::sort(all.begin(), all.end());
+      double p50 = all.empty() ? 0 : all[all.size() / 2] * 1e3;
+      double p99 = all.empty() ? 0 : all[all.size() * 99 / 100] * 1e3;
+
+      std::cout << std::left << std::setw(12) << setting.name << std::setw(8) << modes[m]
+                << std::right << std::fixed << std::setprecision(0) << std::setw(11)
+                << all.size() / t << std::setprecision(2) << std::setw(10) << p50
+                << std::setw(10) << p99;
+      if (failed > 0) {
+        std::cout << "  (" << failed << " failed)";
+      }
+      std::cout << "\n";
+      port++; // don't wait for the old listener to go away
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+// Benchmark for the per-member cost of Room::broadcast_message with
+// 10, 1k and 100k members. For reference it also times the walk over
+// a std::set<User *> that rooms used to store their members in, doing
+// the same enqueues, and a room in log mode (-g), where a broadcast is
+// one append plus a poke for every member that had caught up (all of
+// them here, as in a room of receivers keeping up).
+//
+// Usage: ./bench_fanout [broadcasts per size]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <set>
+#include <ctime>
+#include "frame.h"
+#include "intern.h"
+#include "room.h"
+#include "user.h"
+
+namespace {
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// empty every queue between rounds so they don't grow without bound
+void drain(const std::vector<User *> &users) {
+  for (User *u : users) {
+    while (Frame *f = u->mqueue.try_dequeue()) {
+      f->release();
+    }
+  }
+}
+
+// catch every member up with the log, which also puts them all back
+// on its list of readers to poke
+void drain_log(Room &room, const std::vector<User *> &users) {
+  Frame *frames[16];
+  for (User *u : users) {
+    size_t n;
+    while ((n = room.read_log(u, frames, 16)) > 0) {
+      for (size_t i = 0; i < n; i++) {
+        frames[i]->release();
+      }
+    }
+  }
+}
+
+}
+
+int main(int argc, char **argv) {
+  int rounds = (argc > 1) ? std::stoi(argv[1]) : 5;
+
+  std::cout << "members  set-walk ns/member  room ns/member  log ns/member\n";
+  for (size_t n : { (size_t) 10, (size_t) 1000, (size_t) 100000 }) {
+    Room room("bench");
+    Room log_room("bench-log", FlowLimits(), 1024);
+    uint32_t sender = InternTable::global().intern("sender");
+    std::set<User *> set;
+    std::vector<User *> users;
+    for (size_t i = 0; i < n; i++) {
+      User *u = new User("member" + std::to_string(i));
+      users.push_back(u);
+      set.insert(u);
+      room.add_member(u);
+      log_room.add_member(u);
+    }
+
+    // scale the small rooms up so each size does similar total work
+    int reps = rounds * (int) (100000 / n);
+
+    double set_time = 0, room_time = 0, log_time = 0;
+    for (int r = 0; r < reps; r++) {
+      double start = now_sec();
+      Frame *frame = Frame::make_delivery("bench", "sender", "hello", 5);
+      frame->add_refs(set.size());
+      for (User *u : set) {
+        u->mqueue.enqueue(frame);
+      }
+      frame->release();
+      set_time += now_sec() - start;
+      drain(users);
+
+      start = now_sec();
+      room.broadcast_message(sender, "hello", 5);
+      room_time += now_sec() - start;
+      drain(users);
+
+      start = now_sec();
+      log_room.broadcast_message(sender, "hello", 5);
+      log_time += now_sec() - start;
+      drain_log(log_room, users);
+      drain(users); // nothing is queued, but the pokes are cleared
+    }
+
+    double per = 1e9 / ((double) reps * n);
+    std::cout << std::setw(7) << n << "  " << std::fixed << std::setprecision(1)
+              << std::setw(18) << set_time * per << "  " << std::setw(14) << room_time * per
+              << "  " << std::setw(13) << log_time * per << "\n";
+
+    for (User *u : users) {
+      room.remove_member(u);
+      log_room.remove_member(u);
+      delete u;
+    }
+  }
+
+  return 0;
+}
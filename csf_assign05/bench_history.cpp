@@ -0,0 +1,107 @@
+// Benchmark for room history (-D): appends per second into the mapped
+// segments, how long reopening takes (walking every record to rebuild
+// the indexes), and replay speed for each receiver format, which for
+// brlogin receivers is just pointing at the mapped pages. Runs in a
+// scratch directory under /tmp, removed afterwards.
+//
+// Usage: ./bench_history [messages] [text bytes]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include "frame.h"
+#include "history.h"
+
+namespace {
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void remove_tree(const std::string &dir) {
+  if (DIR *d = opendir(dir.c_str())) {
+    while (struct dirent *e = readdir(d)) {
+      std::string name = e->d_name;
+      if (name != "." && name != "..") {
+        std::string path = dir + "/" + name;
+        if (unlink(path.c_str()) < 0) {
+          remove_tree(path);
+        }
+      }
+    }
+    closedir(d);
+  }
+  rmdir(dir.c_str());
+}
+
+}
+
+int main(int argc, char **argv) {
+  long count = (argc > 1) ? std::stol(argv[1]) : 1000000;
+  size_t text_len = (argc > 2) ? std::stoul(argv[2]) : 64;
+
+  char tmpl[] = "/tmp/bench_history.XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    std::cerr << "can't make a scratch directory\n";
+    return 1;
+  }
+  HistoryConfig config;
+  config.dir = tmpl;
+
+  std::string text(text_len, 'x');
+  std::string room = "bench", sender = "sender";
+
+  RoomHistory *history = RoomHistory::open(config, room);
+  if (!history) {
+    return 1;
+  }
+  double start = now_sec();
+  uint64_t round;
+  for (long i = 0; i < count; i++) {
+    if (history->append(room, sender, text.data(), text.size(), round) == Frame::NO_SEQ) {
+      std::cerr << "append failed\n";
+      return 1;
+    }
+  }
+  double append_t = now_sec() - start;
+  delete history;
+
+  start = now_sec();
+  history = RoomHistory::open(config, room);
+  double open_t = now_sec() - start;
+
+  std::cout << std::fixed << std::setprecision(0)
+            << count << " messages of " << text_len << " bytes\n"
+            << "append      " << std::setw(10) << count / append_t << " msgs/s\n"
+            << "reopen      " << std::setw(10) << count / open_t << " msgs/s\n";
+
+  const char *names[] = { "text", "binary", "binary-ids" };
+  for (int f = 0; f < User::NUM_FORMATS; f++) {
+    HistoryCursor cur(history, 0, history->next_seq(), User::Format(f), 1, true);
+    struct iovec iov[64];
+    size_t bytes = 0;
+    start = now_sec();
+    int n;
+    while ((n = history->read(cur, iov, 64, 64 * 1024)) > 0) {
+      for (int i = 0; i < n; i++) {
+        bytes += iov[i].iov_len;
+      }
+    }
+    double t = now_sec() - start;
+    std::cout << "replay " << std::left << std::setw(10) << names[f] << std::right
+              << std::setw(10) << count / t << " msgs/s  " << std::setw(6)
+              << bytes / t / (1 << 20) << " MB/s\n";
+  }
+
+  delete history;
+  remove_tree(tmpl);
+  return 0;
+}
@@ -0,0 +1,153 @@
+// Microbenchmark for finding line boundaries, in MB/s. First the bare
+// scanners over an in-memory buffer, walked in rio-sized (8 KiB)
+// windows, then the two real readers over a file of protocol lines:
+// csapp's rio_readlineb (a call and a branch per byte) against
+// Connection::receive_view (vectorized scan_lines over the buffer).
+//
+// The default build is -O0, where the intrinsics pay for spilling
+// every vector; compare scanners with an optimized build, e.g.
+//   make clean; make bench CXXFLAGS="-O2 -std=c++14 -D_POSIX_C_SOURCE=200809L"
+//
+// Usage: ./bench_linescan [megabytes]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include "csapp.h"
+#include "message.h"
+#include "connection.h"
+#include "linescan.h"
+
+namespace {
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sendall lines with payloads of 10 to 200 bytes
+std::string make_lines(size_t bytes) {
+  std::string out;
+  out.reserve(bytes + Message::MAX_LEN);
+  unsigned seed = 12345;
+  while (out.size() < bytes) {
+    seed = seed * 1103515245 + 12345;
+    size_t n = 10 + (seed >> 16) % 191;
+    out += "sendall:";
+    out.append(n, 'a' + (seed >> 8) % 26);
+    out += '\n';
+  }
+  return out;
+}
+
+typedef size_t (*ScanFn)(const char *, size_t, uint32_t *, size_t);
+
+size_t scan_memchr(const char *buf, size_t len, uint32_t *ends, size_t max) {
+  size_t found = 0;
+  const char *p = buf, *end = buf + len;
+  while (found < max) {
+    const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (!nl) {
+      break;
+    }
+    ends[found++] = nl + 1 - buf;
+    p = nl + 1;
+  }
+  return found;
+}
+
+// the way read_line consumes a buffer: batches of line ends, then
+// carry the partial last line into the next window
+double run_scan(ScanFn fn, const std::string &data, int reps, size_t &lines) {
+  uint32_t ends[64];
+  lines = 0;
+  double start = now_sec();
+  for (int r = 0; r < reps; r++) {
+    size_t pos = 0;
+    while (pos < data.size()) {
+      size_t window = std::min<size_t>(RIO_BUFSIZE, data.size() - pos);
+      size_t n, consumed = 0;
+      while ((n = fn(data.data() + pos + consumed, window - consumed, ends, 64)) > 0) {
+        lines += n;
+        consumed += ends[n - 1];
+      }
+      pos += (consumed > 0) ? consumed : window;
+    }
+  }
+  return now_sec() - start;
+}
+
+double run_rio(const char *path, size_t &lines) {
+  int fd = open(path, O_RDONLY);
+  rio_t rio;
+  rio_readinitb(&rio, fd);
+  char buf[Message::MAX_LEN + 1];
+  lines = 0;
+  double start = now_sec();
+  while (rio_readlineb(&rio, buf, sizeof(buf)) > 0) {
+    lines++;
+  }
+  double t = now_sec() - start;
+  close(fd);
+  return t;
+}
+
+double run_connection(const char *path, size_t &lines) {
+  Connection conn(open(path, O_RDONLY));
+  MessageView view;
+  lines = 0;
+  double start = now_sec();
+  while (conn.receive_view(view)) {
+    lines++;
+  }
+  return now_sec() - start;
+}
+
+void report(const char *name, size_t bytes, double secs, size_t lines) {
+  std::cout << std::left << std::setw(26) << name << std::right
+            << std::fixed << std::setprecision(0) << std::setw(10)
+            << bytes / secs / 1e6 << "  (" << lines << " lines)\n";
+}
+
+}
+
+int main(int argc, char **argv) {
+  size_t mb = (argc > 1) ? std::stoul(argv[1]) : 64;
+  std::string data = make_lines(mb << 20);
+  size_t lines;
+
+  std::cout << "scanner                         MB/s\n";
+  struct { const char *name; ScanFn fn; } scanners[] = {
+    { "scalar", scan_lines_scalar },
+    { "memchr", scan_memchr },
+    { scan_lines_impl(), scan_lines },
+  };
+  for (auto &s : scanners) {
+    double t = run_scan(s.fn, data, 4, lines);
+    report(s.name, data.size() * 4, t, lines);
+  }
+
+  char path[] = "/tmp/bench_linescan.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, data.data(), data.size()) != (ssize_t) data.size()) {
+    std::cerr << "could not write " << path << "\n";
+    return 1;
+  }
+  close(fd);
+
+  double t = run_rio(path, lines);
+  report("rio_readlineb", data.size(), t, lines);
+  t = run_connection(path, lines);
+  report("Connection::receive_view", data.size(), t, lines);
+
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,80 @@
+// Microbenchmark for MessageQueue: P producer threads enqueue into one
+// queue while a single consumer drains it, for P = 1, 2, 4, ... 32.
+//
+// Usage: ./bench_mqueue [messages per producer]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <pthread.h>
+#include "frame.h"
+#include "message_queue.h"
+
+namespace {
+
+struct BenchState {
+  MessageQueue *queue;
+  Frame *frame;
+  long count;
+};
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *producer(void *arg) {
+  BenchState *st = static_cast<BenchState *>(arg);
+  for (long i = 0; i < st->count; i++) {
+    st->queue->enqueue(st->frame);
+  }
+  return nullptr;
+}
+
+void *consumer(void *arg) {
+  BenchState *st = static_cast<BenchState *>(arg);
+  for (long i = 0; i < st->count; i++) {
+    st->queue->dequeue()->release();
+  }
+  return nullptr;
+}
+
+}
+
+int main(int argc, char **argv) {
+  long per_producer = (argc > 1) ? std::stol(argv[1]) : 200000;
+
+  std::cout << "producers  enqueues/sec\n";
+  for (int p = 1; p <= 32; p *= 2) {
+    MessageQueue queue;
+    Frame *frame = Frame::make_delivery("room", "bench", "hello", 5);
+    frame->add_refs(p * per_producer);
+
+    BenchState prod = { &queue, frame, per_producer };
+    BenchState cons = { &queue, frame, p * per_producer };
+
+    double start = now_sec();
+
+    pthread_t ctid;
+    pthread_create(&ctid, nullptr, consumer, &cons);
+    std::vector<pthread_t> tids(p);
+    for (int i = 0; i < p; i++) {
+      pthread_create(&tids[i], nullptr, producer, &prod);
+    }
+    for (int i = 0; i < p; i++) {
+      pthread_join(tids[i], nullptr);
+    }
+    double enq_done = now_sec();
+    pthread_join(ctid, nullptr);
+
+    frame->release();
+
+    double rate = p * per_producer / (enq_done - start);
+    std::cout << std::setw(9) << p << "  " << std::fixed << std::setprecision(0) << rate << "\n";
+  }
+
+  return 0;
+}
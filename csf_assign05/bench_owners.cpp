@@ -0,0 +1,155 @@
+// Benchmark for the -r mode: S sender threads per room broadcast into
+// R rooms of M members, either directly from the sending threads (the
+// default design, concurrent lock-free broadcasts over the room's
+// snapshot) or by posting to the RoomOwner the room is pinned to.
+// The clock stops when every member has received everything, so the
+// owners' queued-up work is counted too.
+//
+// Usage: ./bench_owners [owner threads] [broadcasts per sender]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <ctime>
+#include <sched.h>
+#include <pthread.h>
+#include "frame.h"
+#include "intern.h"
+#include "room.h"
+#include "room_owner.h"
+#include "user.h"
+
+namespace {
+
+const int SENDERS_PER_ROOM = 2;
+const int MEMBERS_PER_ROOM = 8;
+
+struct SenderArgs {
+  Room *room;
+  RoomOwner *owner; // nullptr: broadcast directly
+  long count;
+};
+
+struct DrainArgs {
+  std::vector<User *> members;
+  long expected; // per member
+};
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *sender(void *arg) {
+  SenderArgs *a = static_cast<SenderArgs *>(arg);
+  uint32_t id = InternTable::global().intern("bench");
+  for (long i = 0; i < a->count; i++) {
+    if (a->owner) {
+      a->owner->post(a->room, id, "hello", 5);
+    } else {
+      a->room->broadcast_message(id, "hello", 5);
+    }
+  }
+  return nullptr;
+}
+
+// one thread per room stands in for the room's receivers
+void *drainer(void *arg) {
+  DrainArgs *a = static_cast<DrainArgs *>(arg);
+  std::vector<long> got(a->members.size(), 0);
+  size_t done = 0;
+  while (done < a->members.size()) {
+    bool idle = true;
+    for (size_t i = 0; i < a->members.size(); i++) {
+      if (got[i] == a->expected) {
+        continue;
+      }
+      while (Frame *f = a->members[i]->mqueue.try_dequeue()) {
+        f->release();
+        idle = false;
+        if (++got[i] == a->expected) {
+          done++;
+          break;
+        }
+      }
+    }
+    if (idle) {
+      sched_yield();
+    }
+  }
+  return nullptr;
+}
+
+double run(int num_rooms, std::vector<RoomOwner *> *owners, long count) {
+  std::vector<Room *> rooms;
+  std::vector<DrainArgs> drains(num_rooms);
+  for (int r = 0; r < num_rooms; r++) {
+    Room *room = new Room("room" + std::to_string(r));
+    rooms.push_back(room);
+    for (int m = 0; m < MEMBERS_PER_ROOM; m++) {
+      User *u = new User("member" + std::to_string(m));
+      room->add_member(u);
+      drains[r].members.push_back(u);
+    }
+    drains[r].expected = SENDERS_PER_ROOM * count;
+  }
+
+  std::vector<SenderArgs> senders;
+  for (int r = 0; r < num_rooms; r++) {
+    RoomOwner *owner = owners ? (*owners)[r % owners->size()] : nullptr;
+    for (int s = 0; s < SENDERS_PER_ROOM; s++) {
+      SenderArgs a = { rooms[r], owner, count };
+      senders.push_back(a);
+    }
+  }
+
+  double start = now_sec();
+  std::vector<pthread_t> tids(senders.size() + drains.size());
+  for (size_t i = 0; i < senders.size(); i++) {
+    pthread_create(&tids[i], nullptr, sender, &senders[i]);
+  }
+  for (size_t i = 0; i < drains.size(); i++) {
+    pthread_create(&tids[senders.size() + i], nullptr, drainer, &drains[i]);
+  }
+  for (pthread_t t : tids) {
+    pthread_join(t, nullptr);
+  }
+  double elapsed = now_sec() - start;
+
+  for (int r = 0; r < num_rooms; r++) {
+    for (User *u : drains[r].members) {
+      rooms[r]->remove_member(u);
+      delete u;
+    }
+    delete rooms[r];
+  }
+  return senders.size() * count / elapsed;
+}
+
+}
+
+int main(int argc, char **argv) {
+  int num_owners = (argc > 1) ? std::stoi(argv[1]) : 4;
+  long count = (argc > 2) ? std::stol(argv[2]) : 20000;
+
+  std::vector<RoomOwner *> owners;
+  for (int i = 0; i < num_owners; i++) {
+    owners.push_back(new RoomOwner);
+    owners.back()->start();
+  }
+
+  std::cout << "broadcasts/sec, " << SENDERS_PER_ROOM << " senders and "
+            << MEMBERS_PER_ROOM << " members per room, " << num_owners << " owners\n";
+  std::cout << "rooms       direct       owners\n";
+  for (int rooms = 1; rooms <= 64; rooms *= 4) {
+    double d = run(rooms, nullptr, count);
+    double o = run(rooms, &owners, count);
+    std::cout << std::setw(5) << rooms << std::fixed << std::setprecision(0)
+              << "  " << std::setw(11) << d << "  " << std::setw(11) << o << "\n";
+  }
+
+  return 0; // the owners are still running, and are left to the exit
+}
@@ -0,0 +1,269 @@
+// Reconnect storm benchmark for resumable receivers (-R). Runs ./server
+// (with -D, so both ways of catching up are available), has a crowd of
+// receivers join a room with sjoin, drops them all, sends [missed] more
+// messages and then brings them all back at once, timing until every
+// one of them has what it missed: once with resume (from the room's
+// in-memory ring) and once with joinsince (a replay from the history
+// files). Reports the deliveries caught up per second and the time
+// until the last receiver was done.
+//
+// Usage: ./bench_resume [receivers] [missed] [port]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace {
+
+struct Receiver {
+  int fd;
+  std::string partial; // an incomplete line from the last read
+  long lines;          // complete lines so far
+  unsigned long long last_seq;
+};
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connect_to(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+bool send_all(int fd, const std::string &s) {
+  return write(fd, s.data(), s.size()) == ssize_t(s.size());
+}
+
+// count the lines in what was read from r, noting the sequence number
+// of the last one (the newest, numbers only go up)
+void take_lines(Receiver &r, const char *buf, ssize_t n) {
+  const char *end = buf + n;
+  const char *line = buf;
+  const char *last = nullptr;
+  while (const char *nl = static_cast<const char *>(memchr(line, '\n', end - line))) {
+    r.lines++;
+    last = line;
+    line = nl + 1;
+  }
+  if (last) {
+    std::string text = (last == buf) ? r.partial + std::string(last, line - last)
+                                     : std::string(last, line - last);
+    if (text.compare(0, 10, "sdelivery:") == 0) {
+      r.last_seq = strtoull(text.c_str() + 10, nullptr, 10);
+    }
+    r.partial.clear();
+  }
+  r.partial.append(line, end - line);
+}
+
+// read from every receiver until each has seen want lines in all,
+// false if that takes more than 30 seconds or a connection drops
+bool wait_for_lines(std::vector<Receiver> &rs, long want) {
+  std::vector<struct pollfd> fds(rs.size());
+  double deadline = now_sec() + 30;
+  char buf[64 * 1024];
+  while (true) {
+    size_t nfds = 0;
+    std::vector<Receiver *> waiting;
+    for (Receiver &r : rs) {
+      if (r.lines < want) {
+        fds[nfds].fd = r.fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        waiting.push_back(&r);
+      }
+    }
+    if (nfds == 0) {
+      return true;
+    }
+    if (now_sec() > deadline || poll(fds.data(), nfds, 1000) < 0) {
+      return false;
+    }
+    for (size_t i = 0; i < nfds; i++) {
+      if (fds[i].revents) {
+        ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+        if (n <= 0) {
+          return false;
+        }
+        take_lines(*waiting[i], buf, n);
+      }
+    }
+  }
+}
+
+// log everyone in and join them with join_for(receiver)
+template <typename JoinFn>
+bool connect_all(std::vector<Receiver> &rs, int port, JoinFn join_for) {
+  for (size_t i = 0; i < rs.size(); i++) {
+    Receiver &r = rs[i];
+    r.fd = connect_to(port);
+    r.partial.clear();
+    r.lines = 0;
+    if (r.fd < 0 || !send_all(r.fd, "rlogin:r" + std::to_string(i) + "\n" + join_for(r))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void close_all(std::vector<Receiver> &rs) {
+  for (Receiver &r : rs) {
+    close(r.fd);
+  }
+}
+
+// read count reply lines from the sender's connection
+bool take_replies(int fd, long count) {
+  char buf[4096];
+  long oks = 0;
+  while (oks < count) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      return false;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      oks += (buf[i] == '\n');
+    }
+  }
+  return true;
+}
+
+// have the sender send count messages and wait for its OKs
+bool send_messages(int fd, long count) {
+  std::string batch;
+  for (long i = 0; i < count; i++) {
+    batch += "sendall:a message of some ordinary length, about sixty bytes\n";
+  }
+  return send_all(fd, batch) && take_replies(fd, count);
+}
+
+pid_t start_server(int port, const std::string &dir, const std::vector<std::string> &args) {
+  std::cout.flush(); // or the child's exit writes it out again
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::vector<const char *> argv = { "server", "-D", dir.c_str() };
+    for (const std::string &arg : args) {
+      argv.push_back(arg.c_str());
+    }
+    std::string p = std::to_string(port);
+    argv.push_back(p.c_str());
+    argv.push_back(nullptr);
+    if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) {
+      _exit(127);
+    }
+    execv("./server", const_cast<char *const *>(argv.data()));
+    _exit(127);
+  }
+  usleep(200000); // let it get to its accept loop
+  return pid;
+}
+
+// one run: returns the catch-up time in seconds, or < 0 on failure
+double run(int port, int nreceivers, long missed, const std::vector<std::string> &args,
+           bool resume) {
+  char dir[] = "/tmp/bench_resume.XXXXXX";
+  if (!mkdtemp(dir)) {
+    return -1;
+  }
+  pid_t server = start_server(port, dir, args);
+  double t = -1;
+
+  std::vector<Receiver> rs(nreceivers);
+  int sender = connect_to(port);
+  bool ok = sender >= 0 && send_all(sender, "slogin:sender\njoin:room\n") && take_replies(sender, 2);
+
+  // everyone joins and gets a first batch, then drops off
+  ok = ok && connect_all(rs, port, [](Receiver &) { return std::string("sjoin:room\n"); })
+          && wait_for_lines(rs, 2) && send_messages(sender, missed)
+          && wait_for_lines(rs, 2 + missed);
+  close_all(rs);
+  usleep(100000); // let the server take them out of the room
+
+  // what they miss, then all of them come back at once
+  ok = ok && send_messages(sender, missed);
+  if (ok) {
+    double start = now_sec();
+    ok = connect_all(rs, port, [resume](Receiver &r) {
+      char line[64];
+      snprintf(line, sizeof(line), resume ? "resume:%llu:room\n" : "joinsince:%llu:room\n",
+               resume ? r.last_seq : r.last_seq + 1);
+      return std::string(line);
+    }) && wait_for_lines(rs, 2 + missed);
+    t = ok ? now_sec() - start : -1;
+    close_all(rs);
+  }
+
+  if (sender >= 0) {
+    close(sender);
+  }
+  kill(server, SIGTERM);
+  waitpid(server, nullptr, 0);
+  std::string rm = std::string("rm -rf ") + dir;
+  if (system(rm.c_str()) != 0) {
+    std::cerr << "couldn't remove " << dir << "\n";
+  }
+  return t;
+}
+
+}
+
+int main(int argc, char **argv) {
+  int nreceivers = (argc > 1) ? std::stoi(argv[1]) : 200;
+  long missed = (argc > 2) ? std::stol(argv[2]) : 1000;
+  int port = (argc > 3) ? std::stoi(argv[3]) : 47700;
+
+  // the ring holds everything that was missed, and a bit more
+  std::string retain = std::to_string(2 * missed + 16);
+  const char *modes[] = { "threads", "epoll" };
+  const char *ways[] = { "joinsince", "resume" };
+
+  std::cout << nreceivers << " receivers catching up on " << missed << " messages each\n"
+            << "mode     catch-up       deliveries/s   last done ms\n";
+  for (int m = 0; m < 2; m++) {
+    for (int w = 0; w < 2; w++) {
+      std::vector<std::string> args = { "-R", retain, "-l", "0", "-m", "0" };
+      if (m == 1) {
+        args.push_back("-e");
+        args.push_back("2");
+      }
+      double t = run(port++, nreceivers, missed, args, w == 1);
+      std::cout << std::left << std::setw(9) << modes[m] << std::setw(12) << ways[w]
+                << std::right << std::fixed << std::setprecision(0);
+      if (t < 0) {
+        std::cout << "      failed\n";
+        continue;
+      }
+      std::cout << std::setw(16) << nreceivers * missed / t << std::setw(15) << t * 1e3 << "\n";
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+// Benchmark for broadcasting in N rooms with M sender threads per
+// room, comparing the sharded RoomRegistry (no server-wide lock) with
+// the old design of one std::map guarded by one mutex that was also
+// held across the whole broadcast.
+//
+// Usage: ./bench_rooms [senders per room] [broadcasts per sender]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <pthread.h>
+#include "intern.h"
+#include "room.h"
+#include "room_registry.h"
+#include "user.h"
+
+namespace {
+
+// the pre-sharding registry: every lookup and broadcast under m_lock
+struct GlobalRegistry {
+  pthread_mutex_t lock;
+  std::map<std::string, Room *> rooms;
+
+  GlobalRegistry() { pthread_mutex_init(&lock, nullptr); }
+  ~GlobalRegistry() {
+    for (auto &entry : rooms) {
+      delete entry.second;
+    }
+    pthread_mutex_destroy(&lock);
+  }
+};
+
+struct SenderArgs {
+  RoomRegistry *sharded;
+  GlobalRegistry *global;
+  std::string room_name;
+  long count;
+};
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *sender(void *arg) {
+  SenderArgs *a = static_cast<SenderArgs *>(arg);
+  uint32_t id = InternTable::global().intern("bench");
+  for (long i = 0; i < a->count; i++) {
+    if (a->sharded) {
+      Room *room = a->sharded->find_or_create(a->room_name);
+      room->broadcast_message(id, "hello", 5);
+    } else {
+      pthread_mutex_lock(&a->global->lock);
+      Room *&room = a->global->rooms[a->room_name];
+      if (!room) {
+        room = new Room(a->room_name);
+      }
+      room->broadcast_message(id, "hello", 5);
+      pthread_mutex_unlock(&a->global->lock);
+    }
+  }
+  return nullptr;
+}
+
+double run(int num_rooms, int per_room, long count, bool sharded) {
+  RoomRegistry reg;
+  GlobalRegistry global;
+  std::vector<User *> members;
+
+  // one receiver per room so every broadcast does a real enqueue
+  for (int r = 0; r < num_rooms; r++) {
+    std::string name = "room" + std::to_string(r);
+    User *u = new User("member");
+    members.push_back(u);
+    if (sharded) {
+      reg.find_or_create(name)->add_member(u);
+    } else {
+      Room *room = new Room(name);
+      global.rooms[name] = room;
+      room->add_member(u);
+    }
+  }
+
+  std::vector<SenderArgs> args;
+  for (int r = 0; r < num_rooms; r++) {
+    for (int s = 0; s < per_room; s++) {
+      SenderArgs a = { sharded ? &reg : nullptr, sharded ? nullptr : &global,
+                       "room" + std::to_string(r), count };
+      args.push_back(a);
+    }
+  }
+
+  double start = now_sec();
+  std::vector<pthread_t> tids(args.size());
+  for (size_t i = 0; i < args.size(); i++) {
+    pthread_create(&tids[i], nullptr, sender, &args[i]);
+  }
+  for (size_t i = 0; i < args.size(); i++) {
+    pthread_join(tids[i], nullptr);
+  }
+  double elapsed = now_sec() - start;
+
+  for (User *u : members) {
+    delete u; // releases everything still queued
+  }
+  return args.size() * count / elapsed;
+}
+
+}
+
+int main(int argc, char **argv) {
+  int per_room = (argc > 1) ? std::stoi(argv[1]) : 2;
+  long count = (argc > 2) ? std::stol(argv[2]) : 20000;
+
+  std::cout << "rooms  senders  global-lock/sec  sharded/sec\n";
+  for (int rooms = 1; rooms <= 64; rooms *= 4) {
+    double g = run(rooms, per_room, count, false);
+    double s = run(rooms, per_room, count, true);
+    std::cout << std::setw(5) << rooms << "  " << std::setw(7) << rooms * per_room
+              << "  " << std::fixed << std::setprecision(0)
+              << std::setw(15) << g << "  " << std::setw(11) << s << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,236 @@
+// Benchmark for spilling lagging receivers' queues to disk (-o spill).
+// Runs ./server with unbounded queues and then with -o spill, has one
+// receiver stop reading while a sender sends [messages] sendalls, and
+// then lets it drain everything. Reports the server's peak resident
+// memory (VmHWM) by the end of the burst, how fast the sender got its
+// OKs, how fast the receiver drained, and whether it got every message
+// in order.
+//
+// Usage: ./bench_spill [messages] [queue limit] [port]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace {
+
+double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a small receive buffer, so what the receiver doesn't read stays in
+// the server rather than in the kernel
+int connect_to(int port, int rcvbuf = 0) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0 && rcvbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+bool send_all(int fd, const std::string &s) {
+  return write(fd, s.data(), s.size()) == ssize_t(s.size());
+}
+
+// read count reply lines
+bool take_replies(int fd, long count) {
+  char buf[4096];
+  long oks = 0;
+  while (oks < count) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      return false;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      oks += (buf[i] == '\n');
+    }
+  }
+  return true;
+}
+
+// the server's peak resident set so far, in MiB
+double peak_rss_mb(pid_t pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::stol(line.substr(6)) / 1024.0;
+    }
+  }
+  return 0;
+}
+
+pid_t start_server(int port, const std::vector<std::string> &args) {
+  std::cout.flush(); // or the child's exit writes it out again
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::vector<const char *> argv = { "server" };
+    for (const std::string &arg : args) {
+      argv.push_back(arg.c_str());
+    }
+    std::string p = std::to_string(port);
+    argv.push_back(p.c_str());
+    argv.push_back(nullptr);
+    if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) {
+      _exit(127);
+    }
+    execv("./server", const_cast<char *const *>(argv.data()));
+    _exit(127);
+  }
+  usleep(200000); // let it get to its accept loop
+  return pid;
+}
+
+struct Result {
+  double rss_mb;
+  double send_rate;  // OKs per second during the burst
+  double drain_rate; // deliveries per second once the receiver reads
+  long received;
+  bool in_order;
+};
+
+// drain the receiver until count deliveries have come, checking that
+// they are "msg 0", "msg 1", ... in order
+bool drain(int fd, long count, Result &res) {
+  char buf[64 * 1024];
+  std::string partial;
+  res.in_order = true;
+  while (res.received < count) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      return false;
+    }
+    partial.append(buf, n);
+    size_t start = 0, nl;
+    while ((nl = partial.find('\n', start)) != std::string::npos) {
+      size_t num = partial.rfind("msg ", nl);
+      if (num == std::string::npos || num < start
+          || strtol(partial.c_str() + num + 4, nullptr, 10) != res.received) {
+        res.in_order = false;
+      }
+      res.received++;
+      start = nl + 1;
+    }
+    partial.erase(0, start);
+  }
+  return true;
+}
+
+bool run(int port, long count, const std::vector<std::string> &args, Result &res) {
+  pid_t server = start_server(port, args);
+  res = Result();
+  bool ok = false;
+
+  int receiver = connect_to(port, 16 * 1024);
+  int sender = connect_to(port);
+  if (receiver >= 0 && sender >= 0
+      && send_all(receiver, "rlogin:audit\njoin:room\n") && take_replies(receiver, 2)
+      && send_all(sender, "slogin:sender\njoin:room\n") && take_replies(sender, 2)) {
+    // the burst, a thousand at a time, while the receiver reads nothing
+    const long BATCH = 1000;
+    double start = now_sec();
+    ok = true;
+    for (long i = 0; ok && i < count; i += BATCH) {
+      std::string batch;
+      long n = std::min(BATCH, count - i);
+      for (long j = 0; j < n; j++) {
+        batch += "sendall:an audit record of some ordinary length, msg " + std::to_string(i + j)
+               + "\n";
+      }
+      ok = send_all(sender, batch) && take_replies(sender, n);
+    }
+    res.send_rate = count / (now_sec() - start);
+    res.rss_mb = peak_rss_mb(server);
+
+    start = now_sec();
+    ok = ok && drain(receiver, count, res);
+    res.drain_rate = res.received / (now_sec() - start);
+  }
+
+  if (receiver >= 0) {
+    close(receiver);
+  }
+  if (sender >= 0) {
+    close(sender);
+  }
+  kill(server, SIGTERM);
+  waitpid(server, nullptr, 0);
+  return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+  long count = (argc > 1) ? std::stol(argv[1]) : 500000;
+  std::string limit = (argc > 2) ? argv[2] : "10000";
+  int port = (argc > 3) ? std::stoi(argv[3]) : 47800;
+
+  char dir[] = "/tmp/bench_spill.XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::cerr << "can't make a scratch directory\n";
+    return 1;
+  }
+
+  struct Setting {
+    const char *name;
+    std::vector<std::string> args;
+  };
+  const Setting settings[] = {
+    { "unbounded", { "-l", "0", "-m", "0" } },
+    { "spill",     { "-l", limit, "-m", "0", "-o", "spill", "-P", dir } },
+  };
+  const char *modes[] = { "threads", "epoll" };
+
+  std::cout << count << " messages to a receiver that isn't reading, spill limit " << limit
+            << "\n"
+            << "queue      mode     peak MiB      sent/s   drained/s  received  in order\n";
+  for (const Setting &setting : settings) {
+    for (int m = 0; m < 2; m++) {
+      std::vector<std::string> args = setting.args;
+      if (m == 1) {
+        args.push_back("-e");
+        args.push_back("2");
+      }
+      Result res;
+      bool ok = run(port++, count, args, res);
+      std::cout << std::left << std::setw(11) << setting.name << std::setw(8) << modes[m]
+                << std::right << std::fixed << std::setprecision(1) << std::setw(10)
+                << res.rss_mb << std::setprecision(0) << std::setw(12) << res.send_rate
+                << std::setw(12) << res.drain_rate << std::setw(10) << res.received
+                << std::setw(10) << (res.in_order ? "yes" : "no")
+                << (ok ? "" : "  (failed)") << "\n";
+    }
+  }
+
+  rmdir(dir);
+  return 0;
+}
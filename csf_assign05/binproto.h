@@ -0,0 +1,180 @@
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "message.h"
+
+// Optional binary framing. A client asks for it by logging in with
+// bslogin/brlogin instead of slogin/rlogin; the server's reply to the
+// login is still a text line, and everything after it in both
+// directions is binary frames:
+//
+//   byte 0     tag (BinTag)
+//   byte 1     flags (none defined yet, must be 0)
+//   bytes 2-3  reserved, 0
+//   bytes 4-7  payload length, big endian
+//   payload    length bytes, anything at all (no newline scanning,
+//              no escaping, up to BIN_MAX_PAYLOAD)
+//
+// A delivery's payload is the room and sender names, each preceded by
+// a one byte length, followed by the message text as the sender sent
+// it.
+//
+// A receiver that logs in with irlogin uses binary frames too, but its
+// deliveries name the room and sender by their interned IDs instead
+// (idelivery: 4 byte room ID, 4 byte sender ID, text). Before it sees
+// an ID it is sent a name frame (4 byte ID, then the name): the room
+// and its senders so far when it joins, later senders as they join.
+//
+// A receiver that joined with sjoin or resume gets sdelivery or
+// sidelivery frames instead: the room's 8 byte sequence number for the
+// delivery, big endian, followed by the payload a delivery or
+// idelivery would have.
+
+#define TAG_SLOGIN_BIN  "bslogin"   // like slogin, then switch to binary frames
+#define TAG_RLOGIN_BIN  "brlogin"   // like rlogin, then switch to binary frames
+#define TAG_RLOGIN_IDS  "irlogin"   // like brlogin, with deliveries by ID
+#define TAG_DELIVERY_ID "idelivery" // delivery naming room and sender by ID
+#define TAG_NAME        "name"      // announces the name behind an ID
+#define TAG_DELIVERY_ID_SEQ "sidelivery" // idelivery stamped with a sequence number
+
+enum BinTag {
+  BIN_ERR = 1,
+  BIN_OK,
+  BIN_JOIN,
+  BIN_LEAVE,
+  BIN_SENDALL,
+  BIN_SENDUSER,
+  BIN_QUIT,
+  BIN_DELIVERY,
+  BIN_EMPTY,
+  BIN_DELIVERY_ID,
+  BIN_NAME,
+  BIN_MISSED, // payload: 4 byte count
+  BIN_JOIN_LAST,
+  BIN_JOIN_SINCE,
+  BIN_JOIN_SEQ,
+  BIN_RESUME,
+  BIN_DELIVERY_SEQ,
+  BIN_DELIVERY_ID_SEQ,
+  BIN_NUM_TAGS
+};
+
+const size_t BIN_HEADER_LEN = 8;
+const size_t BIN_MAX_PAYLOAD = 64 * 1024;
+
+// the text tag for a binary tag, or nullptr if it isn't one
+inline const char *bin_tag_name(unsigned tag) {
+  static const char *const names[] = {
+    nullptr, TAG_ERR, TAG_OK, TAG_JOIN, TAG_LEAVE, TAG_SENDALL,
+    TAG_SENDUSER, TAG_QUIT, TAG_DELIVERY, TAG_EMPTY,
+    TAG_DELIVERY_ID, TAG_NAME, TAG_MISSED, TAG_JOIN_LAST, TAG_JOIN_SINCE,
+    TAG_JOIN_SEQ, TAG_RESUME, TAG_DELIVERY_SEQ, TAG_DELIVERY_ID_SEQ,
+  };
+  return (tag < sizeof(names) / sizeof(names[0])) ? names[tag] : nullptr;
+}
+
+// the binary tag for a text tag, or 0 if there is none
+inline unsigned bin_tag_code(const char *tag, size_t tag_len) {
+  for (unsigned t = BIN_ERR; t < BIN_NUM_TAGS; t++) {
+    const char *name = bin_tag_name(t);
+    if (strlen(name) == tag_len && memcmp(name, tag, tag_len) == 0) {
+      return t;
+    }
+  }
+  return 0;
+}
+
+inline char *bin_put_header(char *p, unsigned tag, size_t len) {
+  p[0] = static_cast<char>(tag);
+  p[1] = p[2] = p[3] = 0;
+  p[4] = static_cast<char>(len >> 24);
+  p[5] = static_cast<char>(len >> 16);
+  p[6] = static_cast<char>(len >> 8);
+  p[7] = static_cast<char>(len);
+  return p + BIN_HEADER_LEN;
+}
+
+inline char *bin_put_u32(char *p, uint32_t v) {
+  p[0] = static_cast<char>(v >> 24);
+  p[1] = static_cast<char>(v >> 16);
+  p[2] = static_cast<char>(v >> 8);
+  p[3] = static_cast<char>(v);
+  return p + 4;
+}
+
+inline char *bin_put_u64(char *p, uint64_t v) {
+  return bin_put_u32(bin_put_u32(p, uint32_t(v >> 32)), uint32_t(v));
+}
+
+inline uint32_t bin_get_u32(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | u[3];
+}
+
+inline uint64_t bin_get_u64(const char *p) {
+  return (uint64_t(bin_get_u32(p)) << 32) | bin_get_u32(p + 4);
+}
+
+// whether a delivery fits a frame even with a sequence number in front:
+// a broadcast is only numbered (and kept, by the history or a room's
+// ring) if it does, so both count the same ones
+inline bool bin_delivery_fits(size_t room_len, size_t sender_len, size_t text_len) {
+  return 8 + 1 + room_len + 1 + sender_len + text_len <= BIN_MAX_PAYLOAD;
+}
+
+// parse a header, false if it isn't one we understand
+inline bool bin_get_header(const char *p, unsigned &tag, size_t &len) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  tag = u[0];
+  len = (size_t(u[4]) << 24) | (size_t(u[5]) << 16) | (size_t(u[6]) << 8) | u[7];
+  return bin_tag_name(tag) && u[1] == 0 && len <= BIN_MAX_PAYLOAD;
+}
+
+// point a MessageView at a frame's payload (the header is parsed
+// separately, since the payload may be somewhere else)
+inline void bin_view(MessageView &view, unsigned tag, const char *payload, size_t len) {
+  view.tag = bin_tag_name(tag);
+  view.tag_len = strlen(view.tag);
+  view.data = payload;
+  view.data_len = len;
+}
+
+// header + payload size of msg as a binary frame
+inline size_t bin_encoded_len(const Message &msg) {
+  return BIN_HEADER_LEN + msg.data.size();
+}
+
+// msg as a binary frame, buf must have room for bin_encoded_len bytes
+inline char *bin_encode_to(const Message &msg, char *buf) {
+  buf = bin_put_header(buf, bin_tag_code(msg.tag.data(), msg.tag.size()), msg.data.size());
+  memcpy(buf, msg.data.data(), msg.data.size());
+  return buf + msg.data.size();
+}
+
+inline void bin_encode_append(const Message &msg, std::string &out) {
+  size_t pos = out.size();
+  out.resize(pos + bin_encoded_len(msg));
+  bin_encode_to(msg, &out[pos]);
+}
+
+// split a delivery payload into its room, sender and text
+inline bool bin_split_delivery(const std::string &payload, std::string &room,
+                               std::string &sender, std::string &text) {
+  size_t pos = 0;
+  std::string *fields[] = { &room, &sender };
+  for (std::string *f : fields) {
+    if (pos >= payload.size() || pos + 1 + uint8_t(payload[pos]) > payload.size()) {
+      return false;
+    }
+    size_t n = uint8_t(payload[pos]);
+    f->assign(payload, pos + 1, n);
+    pos += 1 + n;
+  }
+  text.assign(payload, pos, std::string::npos);
+  return true;
+}
+
+#endif // BINPROTO_H
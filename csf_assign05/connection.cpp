@@ -4,15 +4,27 @@
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
+#include "linescan.h"
+#include "binproto.h"
 
 Connection::Connection()
   : m_fd(-1)
-  , m_last_result(SUCCESS) {
+  , m_last_result(SUCCESS)
+  , m_binary(false)
+  , m_outlen(0)
+  , m_scan_base(nullptr)
+  , m_line_count(0)
+  , m_line_next(0) {
 }
 
 Connection::Connection(int fd)
   : m_fd(fd)
-  , m_last_result(SUCCESS) {
+  , m_last_result(SUCCESS)
+  , m_binary(false)
+  , m_outlen(0)
+  , m_scan_base(nullptr)
+  , m_line_count(0)
+  , m_line_next(0) {
   // TODO: call rio_readinitb to initialize the rio_t object
   rio_readinitb(&m_fdbuf, fd); // initialize buffered io for socket descriptor
 }
@@ -61,45 +73,115 @@ bool Connection::send(const Message &msg) {
   // TODO: send a message
   // return true if successful, false if not
   // make sure that m_last_result is set appropriately
-  std::string encoded = msg.encode(); // get msg encoded to tag:data format
+  return send_buffered(msg) && flush();
+}
+
+bool Connection::send_buffered(const Message &msg) {
+  size_t len = m_binary ? bin_encoded_len(msg) : msg.encoded_len();
+  size_t limit = m_binary ? BIN_HEADER_LEN + BIN_MAX_PAYLOAD : Message::MAX_LEN;
 
   // if more than protocol limit then its invalid
-  if (encoded.size() > Message::MAX_LEN) {
+  if (len > limit) {
     m_last_result = INVALID_MSG;
     return false;
   }
-  
-  ssize_t n = rio_writen(m_fd, const_cast<char *>(encoded.c_str()), encoded.size()); // send with a write (handle short writes and interruptions)
+
+  if (m_outlen + len > sizeof(m_outbuf) && !flush()) {
+    return false;
+  }
+
+  if (len > sizeof(m_outbuf)) {
+    // a big binary frame: write the payload straight from msg
+    char header[BIN_HEADER_LEN];
+    bin_put_header(header, bin_tag_code(msg.tag.data(), msg.tag.size()), msg.data.size());
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<char *>(msg.data.data());
+    iov[1].iov_len = msg.data.size();
+    return send_iov(iov, 2);
+  }
+
+  // encode straight into our own buffer, nothing is allocated
+  if (m_binary) {
+    bin_encode_to(msg, m_outbuf + m_outlen);
+  } else {
+    msg.encode_to(m_outbuf + m_outlen);
+  }
+  m_outlen += len;
+
+  m_last_result = SUCCESS;
+  return true;
+}
+
+bool Connection::flush() {
+  if (m_outlen == 0) {
+    m_last_result = SUCCESS;
+    return true;
+  }
+
+  ssize_t n = rio_writen(m_fd, m_outbuf, m_outlen); // send with a write (handle short writes and interruptions)
 
   // if write not work or not complete have error
-  if (n != (ssize_t)encoded.size()) {
+  if (n != (ssize_t)m_outlen) {
+    m_outlen = 0;
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
+  m_outlen = 0;
   m_last_result = SUCCESS; // the result is successful
   return true; // indicate success too
 }
 
+bool Connection::has_buffered_message() {
+  rio_t *rp = &m_fdbuf;
+  if (m_binary) {
+    unsigned tag;
+    size_t len;
+    return rp->rio_cnt >= (int) BIN_HEADER_LEN
+      && bin_get_header(rp->rio_bufptr, tag, len)
+      && (size_t) rp->rio_cnt >= BIN_HEADER_LEN + len;
+  }
+  if (m_line_next < m_line_count) {
+    return true;
+  }
+  return find_newline(rp->rio_bufptr, rp->rio_cnt) != nullptr;
+}
+
+void Connection::set_binary(bool binary) {
+  m_binary = binary;
+  m_line_count = m_line_next = 0; // any line ends found are stale now
+}
+
 bool Connection::receive(Message &msg) {
   // TODO: receive a message, storing its tag and data in msg
   // return true if successful, false if not
   // make sure that m_last_result is set appropriately
-  char buf[Message::MAX_LEN + 1]; // buffer here to store a single incoming msg
+  MessageView view;
+  if (!receive_view(view)) {
+    return false;
+  }
 
-  ssize_t n = rio_readlineb(&m_fdbuf, buf, Message::MAX_LEN); // one line read terminated by \n
+  msg.assign(view); // the only copy, out of our read buffer
+  return true;
+}
 
-  // if file end or error
-  if (n <= 0) {
-    m_last_result = EOF_OR_ERROR; // mark result and return false
-    return false;
+bool Connection::receive_view(MessageView &view) {
+  if (m_binary) {
+    return read_frame(view);
   }
 
-  buf[n] = '\0'; // make sure null terminating
-  std::string line(buf); // convert this to std::string
+  const char *line;
+  size_t len;
+
+  // one line read terminated by \n, left where it is in m_fdbuf
+  if (!read_line(line, len)) {
+    return false;
+  }
 
-  // deocde the line into message of tag:data
-  if (!msg.decode(line)) {
+  // decode the line into message of tag:data
+  if (!view.decode(line, len)) {
     m_last_result = INVALID_MSG;
     return false;
   }
@@ -107,3 +189,156 @@ bool Connection::receive(Message &msg) {
   m_last_result = SUCCESS; // result message successfully read/decoded
   return true; // indicate this success
 }
+
+bool Connection::read_line(const char *&line, size_t &len) {
+  rio_t *rp = &m_fdbuf;
+  size_t scanned = 0; // leading bytes already known to have no newline
+
+  while (m_line_next == m_line_count) {
+    // index every complete line that is buffered (up to a batch) in
+    // one vectorized pass, later calls just pop the next line end
+    m_scan_base = rp->rio_bufptr + scanned;
+    m_line_next = 0;
+    m_line_count = scan_lines(m_scan_base, rp->rio_cnt - scanned, m_line_ends, LINE_BATCH);
+    if (m_line_count > 0) {
+      break;
+    }
+    scanned = rp->rio_cnt;
+
+    if (scanned >= Message::MAX_LEN) {
+      rp->rio_cnt = 0; // can't be a valid line, throw it away
+      m_last_result = INVALID_MSG;
+      return false;
+    }
+
+    // move the partial line to the front and read more in behind it
+    if (rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+
+    ssize_t n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt);
+    if (n < 0 && errno == EINTR) {
+      continue; // interrupted by a signal handler, just retry
+    }
+    if (n < 0 || (n == 0 && rp->rio_cnt == 0)) {
+      m_last_result = EOF_OR_ERROR; // mark result and return false
+      return false;
+    }
+    if (n == 0) {
+      // EOF after an unterminated last line, hand it over as is
+      line = rp->rio_bufptr;
+      len = rp->rio_cnt;
+      rp->rio_cnt = 0;
+      return true;
+    }
+    rp->rio_cnt += n;
+  }
+
+  // the buffer hasn't moved since the scan, so the offset still holds
+  const char *end = m_scan_base + m_line_ends[m_line_next++];
+  line = rp->rio_bufptr;
+  len = end - line;
+  rp->rio_bufptr += len;
+  rp->rio_cnt -= len;
+  if (len > Message::MAX_LEN) {
+    m_last_result = INVALID_MSG; // longer than the protocol allows
+    return false;
+  }
+  return true;
+}
+
+bool Connection::fill(size_t n) {
+  rio_t *rp = &m_fdbuf;
+  if ((size_t) rp->rio_cnt >= n) {
+    return true;
+  }
+
+  // make room behind what is buffered
+  if (rp->rio_bufptr + n > rp->rio_buf + sizeof(rp->rio_buf)) {
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+  }
+
+  while ((size_t) rp->rio_cnt < n) {
+    char *end = rp->rio_bufptr + rp->rio_cnt;
+    ssize_t got = read(rp->rio_fd, end, rp->rio_buf + sizeof(rp->rio_buf) - end);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+    rp->rio_cnt += got;
+  }
+  return true;
+}
+
+bool Connection::read_frame(MessageView &view) {
+  rio_t *rp = &m_fdbuf;
+
+  if (!fill(BIN_HEADER_LEN)) {
+    return false;
+  }
+  unsigned tag;
+  size_t len;
+  if (!bin_get_header(rp->rio_bufptr, tag, len)) {
+    m_last_result = INVALID_MSG;
+    return false;
+  }
+  rp->rio_bufptr += BIN_HEADER_LEN;
+  rp->rio_cnt -= BIN_HEADER_LEN;
+
+  if (len <= sizeof(rp->rio_buf)) {
+    // the usual case: the payload is used where it lies in rio_buf
+    if (!fill(len)) {
+      return false;
+    }
+    bin_view(view, tag, rp->rio_bufptr, len);
+    rp->rio_bufptr += len;
+    rp->rio_cnt -= len;
+  } else {
+    // bigger than our read buffer, assemble it in m_bigbuf
+    m_bigbuf.resize(len);
+    size_t have = rp->rio_cnt;
+    memcpy(&m_bigbuf[0], rp->rio_bufptr, have);
+    rp->rio_cnt = 0;
+    rp->rio_bufptr = rp->rio_buf;
+    if (rio_readn(rp->rio_fd, &m_bigbuf[have], len - have) != (ssize_t) (len - have)) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+    bin_view(view, tag, m_bigbuf.data(), len);
+  }
+
+  m_last_result = SUCCESS;
+  return true;
+}
+
+bool Connection::send_iov(struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(m_fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue; // interrupted by a signal handler, just retry
+      }
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+
+    // short write: skip what went out and resume mid-buffer
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  m_last_result = SUCCESS;
+  return true;
+}
@@ -1,8 +1,11 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <cstdint>
+#include <string>
+#include <sys/uio.h>
 #include "csapp.h"
-struct Message;
+#include "message.h"
 
 class Connection {
 public:
@@ -41,6 +44,30 @@ public:
   bool send(const Message &msg);
   bool receive(Message &msg);
 
+  // for pipelining: send_buffered encodes msg into the output buffer
+  // (writing it out only if the buffer fills up) and flush writes
+  // whatever is buffered; send is send_buffered followed by flush
+  bool send_buffered(const Message &msg);
+  bool flush();
+
+  // true if a complete message has already been read from the
+  // socket, i.e. the next receive won't block
+  bool has_buffered_message();
+
+  // switch to (or from) the binary framing in binproto.h, for both
+  // sending and receiving; done right after the login exchange
+  void set_binary(bool binary);
+  bool is_binary() const { return m_binary; }
+
+  // receive one line and decode it in place: the view points into our
+  // read buffer and is only valid until the next receive
+  bool receive_view(MessageView &view);
+
+  // send already encoded buffers (e.g. shared delivery Frames) with as
+  // few writev calls as possible (iov is used as scratch space and is
+  // modified)
+  bool send_iov(struct iovec *iov, int iovcnt);
+
   Result get_last_result() const { return m_last_result; }
 
 private:
@@ -48,11 +75,31 @@ private:
   Connection(const Connection &);
   Connection &operator=(const Connection &);
 
+  // find the next complete line in m_fdbuf, refilling it as needed
+  bool read_line(const char *&line, size_t &len);
+
+  // binary mode: read one frame, and make sure at least n bytes
+  // (no more than the buffer holds) are buffered in m_fdbuf
+  bool read_frame(MessageView &view);
+  bool fill(size_t n);
+
   // these are the recommended member variables for the
   // Connection class
   int m_fd;
   rio_t m_fdbuf; // used to allow buffered input
   Result m_last_result;
+  bool m_binary;
+  std::string m_bigbuf; // binary payloads that don't fit in m_fdbuf
+  char m_outbuf[RIO_BUFSIZE]; // messages are encoded in here until flushed
+  size_t m_outlen;
+
+  // line ends found in m_fdbuf by the last scan, as offsets from
+  // m_scan_base; m_line_next..m_line_count haven't been returned yet
+  enum { LINE_BATCH = 64 };
+  const char *m_scan_base;
+  uint32_t m_line_ends[LINE_BATCH];
+  size_t m_line_count;
+  size_t m_line_next;
 };
 
 #endif // CONNECTION_H
@@ -0,0 +1,690 @@
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "message.h"
+#include "frame.h"
+#include "message_queue.h"
+#include "user.h"
+#include "guard.h"
+#include "linescan.h"
+#include "binproto.h"
+#include "room.h"
+#include "room_owner.h"
+#include "history.h"
+#include "event_loop.h"
+
+namespace {
+
+const int MAX_EVENTS = 256;
+
+// per wakeup limits so one busy connection can't starve the others,
+// level-triggered epoll brings us back for whatever is left over
+const size_t READ_CHUNK = 4096;
+const size_t READ_BUDGET = 64 * 1024;
+
+// stop pulling deliveries off a receiver's queue while this much
+// output is still waiting for the socket to become writable
+const size_t OUT_HIGH_WATER = 64 * 1024;
+
+// the same mark pauses a client that pipelines requests without
+// reading the replies: no more of its input is parsed (or read) until
+// the socket has taken enough of them. Joined receivers send nothing,
+// their socket is only read from to notice a hangup.
+bool replies_backed_up(const Session *s) {
+  return s->out.size() - s->out_pos >= OUT_HIGH_WATER
+         && !(s->info.role == 'R' && s->info.room);
+}
+
+// log entries taken per read_log call
+const size_t LOG_BATCH = 64;
+
+long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+}
+
+Session::Session(EventLoop *loop, int fd)
+  : loop(loop)
+  , out_pos(0)
+  , events(EPOLLIN | EPOLLRDHUP)
+  , closing(false)
+  , eof(false)
+  , held(false)
+  , held_since(0)
+  , blocked(false)
+  , committing(false)
+  , commit_pos(0)
+  , closed(false)
+  , ready(false)
+  , binary(false) {
+  info.sockfd = fd;
+  info.never_wait = true;
+}
+
+EventLoop::EventLoop(Server *server)
+  : m_server(server)
+  , m_epfd(-1)
+  , m_wakefd(-1)
+  , m_thread(0)
+  , m_signaled(false) {
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+EventLoop::~EventLoop() {
+  if (m_epfd >= 0) {
+    close(m_epfd);
+  }
+  if (m_wakefd >= 0) {
+    close(m_wakefd);
+  }
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool EventLoop::start() {
+  m_epfd = epoll_create1(EPOLL_CLOEXEC);
+  m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_epfd < 0 || m_wakefd < 0) {
+    return false;
+  }
+
+  // the wakeup eventfd is the only registration without a Session
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) < 0) {
+    return false;
+  }
+
+  if (HistoryFlusher::global().running()) {
+    HistoryFlusher::global().add_listener(loop_notify, this);
+  }
+
+  if (pthread_create(&m_thread, nullptr, thread_main, this) != 0) {
+    return false;
+  }
+  pthread_detach(m_thread);
+  return true;
+}
+
+void EventLoop::add_connection(int fd) {
+  bool signal;
+  {
+    Guard g(m_lock);
+    m_new_fds.push_back(fd);
+    signal = !m_signaled;
+    m_signaled = true;
+  }
+
+  if (signal) {
+    uint64_t one = 1;
+    ssize_t rc = write(m_wakefd, &one, sizeof(one));
+    (void) rc; // only fails if the counter is already nonzero
+  }
+}
+
+void EventLoop::wake_session(Session *s) {
+  bool signal = false;
+  {
+    Guard g(m_lock);
+    if (!s->ready) {
+      s->ready = true;
+      m_ready.push_back(s);
+      signal = !m_signaled;
+      m_signaled = true;
+    }
+  }
+
+  if (signal) {
+    uint64_t one = 1;
+    ssize_t rc = write(m_wakefd, &one, sizeof(one));
+    (void) rc;
+  }
+}
+
+void *EventLoop::thread_main(void *arg) {
+  static_cast<EventLoop *>(arg)->run();
+  return nullptr;
+}
+
+void EventLoop::queue_notify(void *arg) {
+  Session *s = static_cast<Session *>(arg);
+  s->loop->wake_session(s);
+}
+
+void EventLoop::loop_notify(void *arg) {
+  EventLoop *loop = static_cast<EventLoop *>(arg);
+  bool signal;
+  {
+    Guard g(loop->m_lock);
+    signal = !loop->m_signaled;
+    loop->m_signaled = true;
+  }
+
+  if (signal) {
+    uint64_t one = 1;
+    ssize_t rc = write(loop->m_wakefd, &one, sizeof(one));
+    (void) rc;
+  }
+}
+
+void EventLoop::run() {
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true) {
+    int n = epoll_wait(m_epfd, events, MAX_EVENTS, hold_timeout());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "[event loop] epoll_wait fail\n";
+      return;
+    }
+
+    for (int i = 0; i < n; i++) {
+      Session *s = static_cast<Session *>(events[i].data.ptr);
+      if (!s) {
+        on_wakeup();
+        continue;
+      }
+      if (s->closed) {
+        continue; // torn down earlier in this batch
+      }
+
+      uint32_t ev = events[i].events;
+      if (ev & (EPOLLIN | EPOLLRDHUP)) {
+        on_readable(s);
+      }
+      if (!s->closed && (ev & EPOLLOUT)) {
+        flush_output(s);
+        if (!s->closed && s->info.role == 'R') {
+          drain_queue(s); // may have stopped early at OUT_HIGH_WATER
+        }
+        resume_input(s); // so may process_input
+      }
+      if (!s->closed && (ev & (EPOLLERR | EPOLLHUP))) {
+        close_session(s);
+      }
+    }
+
+    if (!m_held.empty()) {
+      release_held();
+    }
+
+    // nothing can refer to these any more
+    for (Session *s : m_dead) {
+      delete s;
+    }
+    m_dead.clear();
+  }
+}
+
+void EventLoop::on_wakeup() {
+  uint64_t count;
+  ssize_t rc = read(m_wakefd, &count, sizeof(count));
+  (void) rc;
+
+  std::vector<int> new_fds;
+  std::vector<Session *> ready;
+  {
+    Guard g(m_lock);
+    new_fds.swap(m_new_fds);
+    ready.swap(m_ready);
+    for (Session *s : ready) {
+      s->ready = false;
+    }
+    m_signaled = false;
+  }
+
+  for (int fd : new_fds) {
+    // accepted with SOCK_NONBLOCK already
+    Session *s = new Session(this, fd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = s;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      std::cerr << "[event loop] epoll add fail\n";
+      close(fd);
+      delete s;
+    }
+  }
+
+  for (Session *s : ready) {
+    drain_queue(s);
+  }
+
+  if (!m_committing.empty()) {
+    release_committed();
+  }
+  if (!m_blocked.empty()) {
+    release_blocked(); // a wakeup may be an owner with room again
+  }
+}
+
+void EventLoop::on_readable(Session *s) {
+  char buf[READ_CHUNK];
+  size_t total = 0;
+  while (total < READ_BUDGET) {
+    ssize_t n = read(s->info.sockfd, buf, sizeof(buf));
+    if (n > 0) {
+      s->in.append(buf, n);
+      total += n;
+    } else if (n == 0) {
+      s->eof = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      close_session(s);
+      return;
+    }
+  }
+
+  process_input(s);
+  flush_output(s);
+}
+
+void EventLoop::process_input(Session *s) {
+  // hand every complete request to the protocol, keep the partial tail
+  size_t start = 0;
+  while (!s->closing && !s->held && !s->blocked && !replies_backed_up(s)) {
+    const char *p = s->in.data() + start;
+    size_t avail = s->in.size() - start;
+
+    if (s->binary) {
+      unsigned tag;
+      size_t len;
+      if (avail < BIN_HEADER_LEN) {
+        break;
+      }
+      if (!bin_get_header(p, tag, len)) {
+        queue_reply(s, Message(TAG_ERR, "invalid message"));
+        s->closing = true;
+        break;
+      }
+      if (avail < BIN_HEADER_LEN + len) {
+        break; // the length is known, so this just waits for the rest
+      }
+      MessageView msg;
+      bin_view(msg, tag, p + BIN_HEADER_LEN, len);
+      if (!handle_request(s, msg)) {
+        break;
+      }
+      start += BIN_HEADER_LEN + len;
+      continue;
+    }
+
+    const char *nl = find_newline(p, avail);
+    if (!nl) {
+      break;
+    }
+    size_t len = nl + 1 - p;
+    if (len > Message::MAX_LEN) {
+      queue_reply(s, Message(TAG_ERR, "message too long"));
+      s->closing = true;
+      break;
+    }
+    if (!handle_line(s, p, len)) {
+      break;
+    }
+    start += len;
+  }
+  s->in.erase(0, start);
+
+  // stopped with whole requests left over, resume_input gets to them
+  bool stalled = replies_backed_up(s) && !s->in.empty();
+  if (!s->closing && !s->held && !s->blocked && !stalled && !s->binary && s->in.size() >= Message::MAX_LEN) {
+    queue_reply(s, Message(TAG_ERR, "message too long"));
+    s->closing = true;
+  }
+
+  // requests behind a held reply still get answered after it
+  if (s->eof && !s->held && !s->blocked && !stalled) {
+    s->closing = true;
+  }
+}
+
+bool EventLoop::handle_line(Session *s, const char *line, size_t len) {
+  MessageView msg; // decoded in place, s->in isn't touched until we return
+  if (!msg.decode(line, len)) {
+    queue_reply(s, Message(TAG_ERR, "invalid message"));
+    s->closing = true;
+    return true;
+  }
+  return handle_request(s, msg);
+}
+
+bool EventLoop::handle_request(Session *s, const MessageView &msg) {
+  Server::client_info *c = &s->info;
+  Message &reply = s->reply;
+  bool keep_going;
+
+  if (c->role == '?') {
+    keep_going = m_server->handle_login(c, msg, reply);
+    if (keep_going && c->role == 'R') {
+      // must be in place before the join makes the user visible
+      c->user->mqueue.set_notify(queue_notify, s);
+    }
+  } else if (c->role == 'S') {
+    keep_going = m_server->handle_sender_message(c, msg, reply);
+    if (c->owner_full) {
+      block_on_owner(s);
+      return false;
+    }
+    if (!s->committing && c->commit_round > HistoryFlusher::global().completed()) {
+      // this reply and everything after it wait for the commit, the
+      // rest of the requests already read still share it
+      s->committing = true;
+      s->commit_pos = s->out.size();
+      m_committing.push_back(s);
+    }
+    if (m_server->should_hold_reply(c, msg)) {
+      hold_reply(s);
+      return true;
+    }
+  } else if (!c->room) {
+    keep_going = m_server->handle_receiver_message(c, msg, reply);
+    if (c->replay || !c->resume.done()) {
+      wake_session(s); // drain_queue sends the catch-up, after the reply
+    }
+  } else {
+    return true; // joined receivers don't send anything further
+  }
+
+  queue_reply(s, reply);
+  if (!keep_going) {
+    s->closing = true;
+  }
+
+  // the login reply itself is a line, binary frames start after it
+  if (keep_going && c->binary) {
+    s->binary = true;
+  }
+  return true;
+}
+
+void EventLoop::hold_reply(Session *s) {
+  // s->reply keeps the reply, and flush_output stops reading from the
+  // socket, so nothing after it is parsed until release_held
+  s->held = true;
+  s->held_since = now_ms();
+  m_held.push_back(s);
+  Room::flow_stats().held_oks++;
+
+  // drained since should_hold_reply looked: release_held lets it go
+  if (!s->info.room->notify_drained(loop_notify, this)) {
+    loop_notify(this);
+  }
+}
+
+void EventLoop::block_on_owner(Session *s) {
+  // the sendall stays in s->in, and flush_output stops reading from
+  // the socket, until release_blocked parses it again
+  s->blocked = true;
+  m_blocked.push_back(s);
+
+  RoomOwner *owner = s->info.owner_full;
+  s->info.owner_full = nullptr;
+  if (!owner->notify_space(loop_notify, this)) {
+    loop_notify(this); // made room since try_post looked
+  }
+}
+
+void EventLoop::release_blocked() {
+  std::vector<Session *> blocked;
+  blocked.swap(m_blocked);
+
+  for (Session *s : blocked) {
+    s->blocked = false;
+    process_input(s); // may block again
+    flush_output(s);
+  }
+}
+
+void EventLoop::release_held() {
+  long now = now_ms();
+  std::vector<Session *> held;
+  held.swap(m_held);
+
+  for (Session *s : held) {
+    Room *room = s->info.room; // can't change while s is held
+    long waited = now - s->held_since;
+    bool timed_out = waited >= room->flow_limits().max_delay_ms;
+    // a wakeup only comes once per registration, so still congested
+    // means registering again
+    if (!timed_out && room->notify_drained(loop_notify, this)) {
+      m_held.push_back(s);
+      continue;
+    }
+
+    FlowStats &stats = Room::flow_stats();
+    stats.held_ms += waited;
+    if (timed_out) {
+      stats.timeouts++;
+    }
+
+    s->held = false;
+    queue_reply(s, s->reply);
+    process_input(s); // may hold again
+    flush_output(s);
+  }
+}
+
+int EventLoop::hold_timeout() const {
+  if (m_held.empty()) {
+    return -1;
+  }
+  // the room draining wakes us, so only the earliest max_delay_ms matters
+  long now = now_ms(), wait = -1;
+  for (Session *s : m_held) {
+    long left = s->held_since + s->info.room->flow_limits().max_delay_ms - now;
+    if (wait < 0 || left < wait) {
+      wait = std::max(left, 0L);
+    }
+  }
+  return int(wait);
+}
+
+void EventLoop::release_committed() {
+  uint64_t done = HistoryFlusher::global().completed();
+  std::vector<Session *> committing;
+  committing.swap(m_committing);
+
+  for (Session *s : committing) {
+    if (s->info.commit_round > done) {
+      m_committing.push_back(s);
+      continue;
+    }
+    s->committing = false;
+    flush_output(s); // and start reading again
+    resume_input(s);
+  }
+}
+
+void EventLoop::resume_input(Session *s) {
+  if (!s->closed && !s->in.empty() && !s->held && !s->blocked && !replies_backed_up(s)) {
+    process_input(s);
+    flush_output(s);
+  }
+}
+
+void EventLoop::queue_reply(Session *s, const Message &reply) {
+  // out keeps its capacity between flushes
+  if (s->binary) {
+    bin_encode_append(reply, s->out);
+  } else {
+    reply.encode_append(s->out);
+  }
+}
+
+void EventLoop::drain_queue(Session *s) {
+  if (s->closed || !s->info.user) {
+    return;
+  }
+
+  // history asked for at join goes first, a socket's worth at a time;
+  // until it is all out, live deliveries wait in the queue (or the log)
+  while (HistoryCursor *replay = s->info.replay) {
+    struct iovec iov[LOG_BATCH];
+    while (s->out.size() - s->out_pos < OUT_HIGH_WATER) {
+      int n = replay->history->read(*replay, iov, LOG_BATCH, OUT_HIGH_WATER);
+      if (n == 0) {
+        delete replay;
+        s->info.replay = nullptr;
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        s->out.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+      }
+    }
+    if (s->info.replay) {
+      flush_output(s);
+      if (s->closed || !s->out.empty()) {
+        return; // EPOLLOUT brings us back
+      }
+    }
+  }
+
+  // likewise what a resume missed, from the room's ring
+  Room *room = s->info.room;
+  RetainedCursor &resume = s->info.resume;
+  while (!resume.done()) {
+    Frame *batch[LOG_BATCH];
+    while (s->out.size() - s->out_pos < OUT_HIGH_WATER && !resume.done()) {
+      size_t n = room->read_retained(s->info.user->format, resume, batch, LOG_BATCH);
+      for (size_t i = 0; i < n; i++) {
+        s->out.append(batch[i]->data(), batch[i]->size());
+        batch[i]->release();
+      }
+    }
+    if (!resume.done()) {
+      flush_output(s);
+      if (s->closed || !s->out.empty()) {
+        return; // EPOLLOUT brings us back
+      }
+    }
+  }
+
+  // stopping at the high water mark relies on EPOLLOUT to come back,
+  // so if the socket took all of it there's no waiting for that
+  MessageQueue &q = s->info.user->mqueue;
+  bool full;
+  do {
+    while (s->out.size() - s->out_pos < OUT_HIGH_WATER) {
+      Frame *pending = q.try_dequeue();
+      if (!pending) {
+        break;
+      }
+
+      s->out.append(pending->data(), pending->size());
+      pending->release();
+    }
+
+    // in log mode the deliveries come from the room's log, once
+    // anything queued directly is out (the loop above only stops early
+    // at the high water mark, which stops this one too)
+    if (room && room->has_log()) {
+      Frame *batch[LOG_BATCH];
+      while (s->out.size() - s->out_pos < OUT_HIGH_WATER) {
+        size_t n = room->read_log(s->info.user, batch, LOG_BATCH);
+        if (n == 0) {
+          break; // the next append pokes the queue, which wakes us
+        }
+        for (size_t i = 0; i < n; i++) {
+          s->out.append(batch[i]->data(), batch[i]->size());
+          batch[i]->release();
+        }
+      }
+    }
+
+    full = s->out.size() - s->out_pos >= OUT_HIGH_WATER;
+    flush_output(s);
+  } while (full && !s->closed && s->out.empty());
+}
+
+void EventLoop::flush_output(Session *s) {
+  size_t limit = s->committing ? s->commit_pos : s->out.size();
+  while (s->out_pos < limit) {
+    ssize_t n = write(s->info.sockfd, s->out.data() + s->out_pos, limit - s->out_pos);
+    if (n > 0) {
+      s->out_pos += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      close_session(s);
+      return;
+    }
+  }
+
+  bool pending = s->out_pos < limit;
+  if (s->out_pos == s->out.size()) {
+    s->out.clear();
+    s->out_pos = 0;
+    s->commit_pos = 0;
+  }
+
+  if (s->out.empty() && s->closing) {
+    close_session(s);
+    return;
+  }
+
+  // a held, committing, closing or backed up session isn't read from
+  // (not even for a hangup, which would keep firing), EPOLLHUP and
+  // EPOLLERR still get through
+  bool paused = s->held || s->blocked || s->committing || s->closing || replies_backed_up(s);
+  uint32_t events = (paused ? 0 : EPOLLIN | EPOLLRDHUP) | (pending ? EPOLLOUT : 0);
+  if (events != s->events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(m_epfd, EPOLL_CTL_MOD, s->info.sockfd, &ev);
+    s->events = events;
+  }
+}
+
+void EventLoop::close_session(Session *s) {
+  if (s->closed) {
+    return;
+  }
+  s->closed = true;
+
+  epoll_ctl(m_epfd, EPOLL_CTL_DEL, s->info.sockfd, nullptr);
+
+  // after this no broadcast can wake the session again...
+  m_server->end_session(&s->info);
+
+  if (s->held) {
+    m_held.erase(std::find(m_held.begin(), m_held.end(), s));
+    s->held = false;
+  }
+  if (s->blocked) {
+    m_blocked.erase(std::find(m_blocked.begin(), m_blocked.end(), s));
+    s->blocked = false;
+  }
+  if (s->committing) {
+    m_committing.erase(std::find(m_committing.begin(), m_committing.end(), s));
+    s->committing = false;
+  }
+
+  // ...but an earlier one may have left it on the ready list
+  {
+    Guard g(m_lock);
+    if (s->ready) {
+      m_ready.erase(std::find(m_ready.begin(), m_ready.end(), s));
+      s->ready = false;
+    }
+  }
+
+  close(s->info.sockfd);
+  m_dead.push_back(s);
+}
@@ -0,0 +1,104 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include "server.h"
+#include "message.h"
+
+class EventLoop;
+
+// Per-connection state for the event-loop server mode. The protocol
+// state is the same client_info the threaded mode uses, the rest is
+// the buffering needed because the socket is non-blocking.
+struct Session {
+  Server::client_info info;
+  EventLoop *loop;
+  std::string in;   // bytes received but not yet parsed into lines
+  std::string out;  // encoded lines not yet written to the socket
+  size_t out_pos;   // how much of out has already been written
+  Message reply;    // reused for every reply so its strings stay allocated
+  uint32_t events;  // what the socket is registered with epoll for
+  bool closing;     // close once out has been flushed
+  bool eof;         // the client is done sending, close once in is used up
+  bool held;        // reply held back by flow control, input paused
+  long held_since;  // when (ms, monotonic)
+  bool blocked;     // a sendall waits for space in its room owner's inbox, input paused
+  bool committing;  // out from commit_pos on waits for a group commit, input paused
+  size_t commit_pos;
+  bool closed;      // torn down, freed at the end of the epoll batch
+  bool ready;       // on the loop's ready list (guarded by the loop lock)
+  bool binary;      // past a bslogin/brlogin, in and out are binary frames
+
+  Session(EventLoop *loop, int fd);
+};
+
+// An EventLoop is one thread multiplexing many non-blocking
+// connections with epoll. The accepting thread hands sockets to a loop
+// with add_connection, and a receiver's MessageQueue wakes the loop
+// that owns it (through an eventfd) when a delivery is enqueued.
+// A sender whose OK flow control holds back stops being read from
+// until its room drains (which wakes the loop the same way) or its
+// max_delay_ms runs out. One whose room owner's inbox is full (-r)
+// stops being read from, its sendall left unparsed, until the owner
+// has made room and woken the loop. One whose OKs wait for a group commit stops being read from too, until
+// the flusher says a round has completed.
+class EventLoop {
+public:
+  EventLoop(Server *server);
+  ~EventLoop();
+
+  bool start();
+
+  // both of these may be called from any thread
+  void add_connection(int fd);
+  void wake_session(Session *s);
+
+private:
+  // value semantics prohibited
+  EventLoop(const EventLoop &);
+  EventLoop &operator=(const EventLoop &);
+
+  static void *thread_main(void *arg);
+  static void queue_notify(void *arg);
+  static void loop_notify(void *arg); // group commits, rooms draining, owners
+
+  void run();
+  void on_wakeup();
+  void on_readable(Session *s);
+  void process_input(Session *s);
+  void hold_reply(Session *s);
+  void block_on_owner(Session *s);
+  void release_blocked();
+  void release_held();
+  int hold_timeout() const;
+  void release_committed();
+  void resume_input(Session *s);
+  // false if the request wasn't taken and has to be handled again
+  bool handle_line(Session *s, const char *line, size_t len);
+  bool handle_request(Session *s, const MessageView &msg);
+  void queue_reply(Session *s, const Message &reply);
+  void drain_queue(Session *s);
+  void flush_output(Session *s);
+  void close_session(Session *s);
+
+  Server *m_server;
+  int m_epfd;
+  int m_wakefd;
+  pthread_t m_thread;
+
+  pthread_mutex_t m_lock; // protects everything below
+  bool m_signaled;        // m_wakefd has been written since the last wakeup
+  std::vector<int> m_new_fds;
+  std::vector<Session *> m_ready;
+
+  // only touched by the loop thread
+  std::vector<Session *> m_dead;
+  std::vector<Session *> m_held;
+  std::vector<Session *> m_blocked;
+  std::vector<Session *> m_committing;
+};
+
+#endif // EVENT_LOOP_H
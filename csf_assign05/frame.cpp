@@ -0,0 +1,141 @@
+#include <new>
+#include <cstring>
+#include <cstdio>
+#include "message.h"
+#include "binproto.h"
+#include "pool.h"
+#include "frame.h"
+
+namespace {
+
+// every frame short enough for the text protocol comes from here
+BlockPool frame_pool(sizeof(Frame) + Message::MAX_LEN);
+
+char *append(char *p, const char *s, size_t n) {
+  memcpy(p, s, n);
+  return p + n;
+}
+
+}
+
+Frame *Frame::make_delivery(const std::string &room,
+                            const std::string &sender,
+                            const char *text, size_t text_len,
+                            uint64_t seq) {
+  char prefix[48] = TAG_DELIVERY ":";
+  int prefix_len = sizeof(TAG_DELIVERY);
+  if (seq != NO_SEQ) {
+    prefix_len = snprintf(prefix, sizeof(prefix), TAG_DELIVERY_SEQ ":%llu:",
+                          static_cast<unsigned long long>(seq));
+  }
+  size_t len = prefix_len + room.size() + 1 + sender.size() + 1 + text_len + 1;
+
+  Frame *f = alloc(len);
+
+  char *p = f->buf();
+  p = append(p, prefix, prefix_len);
+  p = append(p, room.data(), room.size());
+  *p++ = ':';
+  p = append(p, sender.data(), sender.size());
+  *p++ = ':';
+  p = append(p, text, text_len);
+  *p = '\n';
+
+  return f;
+}
+
+Frame *Frame::make_delivery_bin(const std::string &room,
+                                const std::string &sender,
+                                const char *text, size_t text_len,
+                                uint64_t seq) {
+  // names are stored with a one byte length (joins enforce this)
+  size_t seq_len = (seq == NO_SEQ) ? 0 : 8;
+  size_t payload = seq_len + 1 + room.size() + 1 + sender.size() + text_len;
+
+  Frame *f = alloc(BIN_HEADER_LEN + payload);
+
+  char *p = bin_put_header(f->buf(), seq_len ? BIN_DELIVERY_SEQ : BIN_DELIVERY, payload);
+  if (seq_len) {
+    p = bin_put_u64(p, seq);
+  }
+  *p++ = static_cast<char>(room.size());
+  p = append(p, room.data(), room.size());
+  *p++ = static_cast<char>(sender.size());
+  p = append(p, sender.data(), sender.size());
+  append(p, text, text_len);
+
+  return f;
+}
+
+Frame *Frame::make_delivery_ids(uint32_t room_id, uint32_t sender_id,
+                                const char *text, size_t text_len,
+                                uint64_t seq) {
+  size_t seq_len = (seq == NO_SEQ) ? 0 : 8;
+  size_t payload = seq_len + 4 + 4 + text_len;
+
+  Frame *f = alloc(BIN_HEADER_LEN + payload);
+
+  char *p = bin_put_header(f->buf(), seq_len ? BIN_DELIVERY_ID_SEQ : BIN_DELIVERY_ID, payload);
+  if (seq_len) {
+    p = bin_put_u64(p, seq);
+  }
+  p = bin_put_u32(p, room_id);
+  p = bin_put_u32(p, sender_id);
+  append(p, text, text_len);
+
+  return f;
+}
+
+Frame *Frame::make_name(uint32_t id, const std::string &name) {
+  size_t payload = 4 + name.size();
+
+  Frame *f = alloc(BIN_HEADER_LEN + payload);
+
+  char *p = bin_put_header(f->buf(), BIN_NAME, payload);
+  p = bin_put_u32(p, id);
+  append(p, name.data(), name.size());
+
+  return f;
+}
+
+Frame *Frame::make_missed(uint32_t count, bool binary) {
+  if (binary) {
+    Frame *f = alloc(BIN_HEADER_LEN + 4);
+    bin_put_u32(bin_put_header(f->buf(), BIN_MISSED, 4), count);
+    return f;
+  }
+
+  char line[32];
+  int len = snprintf(line, sizeof(line), TAG_MISSED ":%u\n", count);
+  Frame *f = alloc(len);
+  append(f->buf(), line, len);
+  return f;
+}
+
+Frame *Frame::make_copy(const char *data, size_t len) {
+  Frame *f = alloc(len);
+  append(f->buf(), data, len);
+  return f;
+}
+
+Frame *Frame::alloc(size_t len) {
+  if (sizeof(Frame) + len <= frame_pool.block_size()) {
+    return new (frame_pool.alloc()) Frame(len, true);
+  }
+  return new (::operator new(sizeof(Frame) + len)) Frame(len, false);
+}
+
+void Frame::release() {
+  if (m_account) {
+    m_account->give_back(long(m_len));
+  }
+  if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    bool pooled = m_pooled;
+    this->~Frame();
+    if (pooled) {
+      frame_pool.free(this);
+    } else {
+      ::operator delete(this);
+    }
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// What Frame::charge counts queued bytes against (a room's flow
+// control). A release that brings bytes down to low calls drained(arg),
+// but only if armed was set since the last call, so a release costs
+// one extra load unless somebody is waiting for the room to drain.
+struct FrameAccount {
+  std::atomic<long> bytes;
+  long low;
+  std::atomic<bool> armed;
+  void (*drained)(void *arg);
+  void *arg;
+
+  FrameAccount() : bytes(0), low(0), armed(false), drained(nullptr), arg(nullptr) { }
+
+  void give_back(long n) {
+    long left = bytes.fetch_sub(n) - n;
+    if (left <= low && armed.load() && armed.exchange(false)) {
+      drained(arg);
+    }
+  }
+};
+
+// A Frame is a fully encoded line ready to be written to a socket as
+// is, e.g. "delivery:room:sender:text\n". A broadcast builds a single
+// Frame and every member's MessageQueue shares it, so fanning out to a
+// member is just a pointer push. Frames are immutable once built and
+// free themselves when the last reference is released.
+//
+// Any frame that fits the text protocol (Message::MAX_LEN) lives in a
+// fixed-size block from a BlockPool, so building and freeing one never
+// touches malloc. Only larger frames fall back to the heap.
+class Frame {
+public:
+  // passed as seq for a delivery without a sequence number
+  static const uint64_t NO_SEQ = ~uint64_t(0);
+
+  // build "delivery:room:sender:text\n", holding one reference, or
+  // "sdelivery:seq:room:sender:text\n" for receivers that asked for
+  // sequence numbers (sjoin/resume); the same goes for the other
+  // formats below
+  static Frame *make_delivery(const std::string &room,
+                              const std::string &sender,
+                              const char *text, size_t text_len,
+                              uint64_t seq = NO_SEQ);
+
+  // the same delivery as a binary frame (see binproto.h), for
+  // receivers that logged in with brlogin; the text is copied as is
+  static Frame *make_delivery_bin(const std::string &room,
+                                  const std::string &sender,
+                                  const char *text, size_t text_len,
+                                  uint64_t seq = NO_SEQ);
+
+  // the delivery for irlogin receivers, naming room and sender by
+  // their interned IDs, and the frame that announces an ID's name
+  static Frame *make_delivery_ids(uint32_t room_id, uint32_t sender_id,
+                                  const char *text, size_t text_len,
+                                  uint64_t seq = NO_SEQ);
+  static Frame *make_name(uint32_t id, const std::string &name);
+
+  // "missed:N\n" (or its binary frame), stands in for the deliveries
+  // a bounded queue dropped
+  static Frame *make_missed(uint32_t count, bool binary);
+
+  // a frame holding a copy of len bytes encoded earlier, used to bring
+  // back a delivery that was spilled to disk
+  static Frame *make_copy(const char *data, size_t len);
+
+  void add_refs(int n) { m_refs.fetch_add(n, std::memory_order_relaxed); }
+  void release();
+
+  // count size() bytes against account for each of the refs references
+  // taken so far; every release then gives its share back, so account
+  // tracks how many bytes of this frame are still queued somewhere
+  void charge(FrameAccount *account, int refs) {
+    m_account = account;
+    account->bytes.fetch_add(long(m_len) * refs, std::memory_order_relaxed);
+  }
+
+  const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+  size_t size() const { return m_len; }
+
+private:
+  Frame(size_t len, bool pooled)
+    : m_refs(1), m_len(len), m_pooled(pooled), m_account(nullptr) { }
+  ~Frame() { }
+
+  static Frame *alloc(size_t len);
+
+  // value semantics prohibited
+  Frame(const Frame &);
+  Frame &operator=(const Frame &);
+
+  char *buf() { return reinterpret_cast<char *>(this + 1); }
+
+  std::atomic<int> m_refs;
+  size_t m_len;
+  bool m_pooled;
+  FrameAccount *m_account; // set by charge, or nullptr
+  // the encoded bytes follow the object in the same allocation
+};
+
+#endif // FRAME_H
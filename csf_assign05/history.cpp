@@ -0,0 +1,719 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "guard.h"
+#include "message.h"
+#include "binproto.h"
+#include "frame.h"
+#include "intern.h"
+#include "history.h"
+
+// Segment file layout: a 64 byte header (magic, then the sequence
+// number of the first record, big endian), then records, each 8 byte
+// aligned:
+//
+//   bytes 0-3  length of the frame (0: no more records)
+//   bytes 4-7  FNV-1a hash of the frame
+//   frame      a binary delivery frame, exactly as brlogin receivers
+//              are sent it
+//
+// The rest of a segment is zeros (it was preallocated), and the
+// length is written last, so a record is either whole or, after a
+// crash, fails its hash and ends the segment.
+
+namespace {
+
+const char MAGIC[8] = { 'C', 'S', 'F', 'H', 'I', 'S', 'T', '1' };
+const size_t SEGMENT_HEADER = 64;
+const size_t RECORD_HEADER = 8;
+
+// the biggest frame a record can hold, and a name frame (irlogin)
+const size_t MAX_RECORD = BIN_HEADER_LEN + BIN_MAX_PAYLOAD;
+const size_t MAX_NAME_FRAME = BIN_HEADER_LEN + 4 + 255;
+
+// room in a cursor's scratch buffer past max_bytes, so the record that
+// crosses max_bytes always fits once encoded
+const size_t SCRATCH_SLACK = MAX_RECORD + 8 + 2 * MAX_NAME_FRAME;
+
+size_t record_span(size_t len) {
+  return (RECORD_HEADER + len + 7) & ~size_t(7);
+}
+
+uint32_t checksum(const char *p, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ uint8_t(p[i])) * 16777619u;
+  }
+  return h;
+}
+
+// a room name as a directory name: anything but letters, digits, '-'
+// and '_' becomes %XX (so no '/', and no "." or "..")
+std::string escape_name(const std::string &name) {
+  static const char hex[] = "0123456789abcdef";
+  std::string out;
+  for (unsigned char ch : name) {
+    if (isalnum(ch) || ch == '-' || ch == '_') {
+      out += char(ch);
+    } else {
+      out += '%';
+      out += hex[ch >> 4];
+      out += hex[ch & 15];
+    }
+  }
+  return out.empty() ? "%" : out;
+}
+
+char *copy(char *p, const char *s, size_t n) {
+  memcpy(p, s, n);
+  return p + n;
+}
+
+char *put_name_frame(char *p, uint32_t id, const char *name, size_t len) {
+  p = bin_put_header(p, BIN_NAME, 4 + len);
+  p = bin_put_u32(p, id);
+  return copy(p, name, len);
+}
+
+}
+
+struct HistorySegment {
+  std::string path;
+  int fd;
+  char *base; // the whole file, mapped
+  size_t size;
+  size_t used; // header and records so far
+  uint64_t first_seq;
+  uint64_t count;
+  time_t sealed; // when the next segment took over, 0 while this one takes appends
+  std::vector<uint32_t> index; // offset of record first_seq + i * INDEX_EVERY
+  std::atomic<int> refs; // the history's, and one per cursor reading it
+
+  HistorySegment()
+    : fd(-1), base(nullptr), size(0), used(SEGMENT_HEADER)
+    , first_seq(0), count(0), sealed(0), refs(1) { }
+
+  uint64_t end_seq() const { return first_seq + count; }
+
+  void pin() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+  void release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      if (base) {
+        munmap(base, size);
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+      delete this;
+    }
+  }
+};
+
+HistoryCursor::HistoryCursor(RoomHistory *history, uint64_t next, uint64_t end,
+                             User::Format format, uint32_t room_id, bool report_gap)
+  : history(history)
+  , next(next)
+  , end(end)
+  , format(format)
+  , room_id(room_id)
+  , report_gap(report_gap)
+  , pinned(nullptr)
+  , pinned_end(0)
+  , pos(0)
+  , last_sender_id(UINT32_MAX) {
+}
+
+HistoryCursor::~HistoryCursor() {
+  if (pinned) {
+    pinned->release();
+  }
+}
+
+RoomHistory::RoomHistory(const HistoryConfig &config, const std::string &dir)
+  : m_config(config)
+  , m_dir(dir)
+  , m_next_seq(0)
+  , m_synced_seq(0)
+  , m_flush_queued(false)
+  , m_failed(false) {
+  // any record has to fit in an empty segment, and the index holds
+  // 32 bit offsets
+  size_t min_size = SEGMENT_HEADER + record_span(MAX_RECORD);
+  m_config.segment_bytes = std::max(m_config.segment_bytes, min_size);
+  m_config.segment_bytes = std::min(m_config.segment_bytes, size_t(1) << 30);
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+RoomHistory::~RoomHistory() {
+  for (HistorySegment *seg : m_segments) {
+    seg->release();
+  }
+  pthread_mutex_destroy(&m_lock);
+}
+
+RoomHistory *RoomHistory::open(const HistoryConfig &config, const std::string &room_name) {
+  std::string dir = config.dir + "/" + escape_name(room_name);
+  if ((mkdir(config.dir.c_str(), 0755) < 0 && errno != EEXIST)
+      || (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)) {
+    std::cerr << "[history] " << dir << ": " << strerror(errno) << "\n";
+    return nullptr;
+  }
+
+  RoomHistory *history = new RoomHistory(config, dir);
+  if (!history->load()) {
+    delete history;
+    return nullptr;
+  }
+  return history;
+}
+
+bool RoomHistory::load() {
+  DIR *d = opendir(m_dir.c_str());
+  if (!d) {
+    std::cerr << "[history] " << m_dir << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  std::vector<std::string> names;
+  while (struct dirent *e = readdir(d)) {
+    std::string name = e->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0) {
+      names.push_back(name);
+    }
+  }
+  closedir(d);
+
+  // the names are zero padded first sequence numbers, so this sorts
+  // them oldest first
+  std::sort(names.begin(), names.end());
+  for (const std::string &name : names) {
+    HistorySegment *seg = load_segment(m_dir + "/" + name);
+    if (seg) {
+      m_segments.push_back(seg);
+    }
+  }
+
+  // the newest carries on taking appends (a new one is only created
+  // when it fills up)
+  if (!m_segments.empty()) {
+    m_segments.back()->sealed = 0;
+    m_next_seq = m_segments.back()->end_seq();
+  }
+  trim();
+  return true;
+}
+
+HistorySegment *RoomHistory::load_segment(const std::string &path) {
+  HistorySegment *seg = new HistorySegment;
+  seg->path = path;
+  seg->fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+  struct stat st;
+  if (seg->fd < 0 || fstat(seg->fd, &st) < 0 || size_t(st.st_size) < SEGMENT_HEADER) {
+    std::cerr << "[history] skipping " << path << ": not a segment\n";
+    seg->release();
+    return nullptr;
+  }
+  seg->size = st.st_size;
+  seg->sealed = st.st_mtime;
+
+  void *base = mmap(nullptr, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+  if (base == MAP_FAILED) {
+    std::cerr << "[history] " << path << ": " << strerror(errno) << "\n";
+    seg->release();
+    return nullptr;
+  }
+  seg->base = static_cast<char *>(base);
+  if (memcmp(seg->base, MAGIC, sizeof(MAGIC)) != 0) {
+    std::cerr << "[history] skipping " << path << ": not a segment\n";
+    seg->release();
+    return nullptr;
+  }
+  seg->first_seq = (uint64_t(bin_get_u32(seg->base + 8)) << 32) | bin_get_u32(seg->base + 12);
+
+  // walk the records to find the end, indexing as we go
+  size_t pos = SEGMENT_HEADER;
+  while (pos + RECORD_HEADER <= seg->size) {
+    const char *rec = seg->base + pos;
+    size_t len = bin_get_u32(rec);
+    if (len == 0) {
+      break;
+    }
+    if (len > MAX_RECORD || pos + record_span(len) > seg->size
+        || bin_get_u32(rec + 4) != checksum(rec + RECORD_HEADER, len)) {
+      // torn by a crash in the middle of an append: clear it away, so
+      // appends carry on from clean zeros
+      std::cerr << "[history] " << path << ": cut off at record " << seg->end_seq() << "\n";
+      memset(seg->base + pos, 0, seg->size - pos);
+      break;
+    }
+    if (seg->count % INDEX_EVERY == 0) {
+      seg->index.push_back(uint32_t(pos));
+    }
+    pos += record_span(len);
+    seg->count++;
+  }
+  seg->used = pos;
+  return seg;
+}
+
+HistorySegment *RoomHistory::create_segment(uint64_t first_seq) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%020llu.seg", (unsigned long long) first_seq);
+
+  HistorySegment *seg = new HistorySegment;
+  seg->path = m_dir + name;
+  seg->size = m_config.segment_bytes;
+  seg->first_seq = first_seq;
+  seg->fd = ::open(seg->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (seg->fd < 0) {
+    std::cerr << "[history] " << seg->path << ": " << strerror(errno) << "\n";
+    seg->release();
+    return nullptr;
+  }
+
+  // take the blocks now, so the disk can't fill up under an append
+  // (just make the file the right size where that isn't supported)
+  int rc = posix_fallocate(seg->fd, 0, seg->size);
+  if (rc != 0 && (rc == ENOSPC || ftruncate(seg->fd, seg->size) < 0)) {
+    std::cerr << "[history] " << seg->path << ": " << strerror(rc ? rc : errno) << "\n";
+    unlink(seg->path.c_str());
+    seg->release();
+    return nullptr;
+  }
+
+  void *base = mmap(nullptr, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+  if (base == MAP_FAILED) {
+    std::cerr << "[history] " << seg->path << ": " << strerror(errno) << "\n";
+    unlink(seg->path.c_str());
+    seg->release();
+    return nullptr;
+  }
+  seg->base = static_cast<char *>(base);
+
+  memcpy(seg->base, MAGIC, sizeof(MAGIC));
+  bin_put_u32(seg->base + 8, uint32_t(first_seq >> 32));
+  bin_put_u32(seg->base + 12, uint32_t(first_seq));
+  return seg;
+}
+
+bool RoomHistory::rotate() {
+  // an empty newest segment can only be too small for this record
+  // (made with a smaller -S), it has nothing worth keeping
+  if (!m_segments.empty() && m_segments.back()->count == 0) {
+    HistorySegment *empty = m_segments.back();
+    unlink(empty->path.c_str());
+    m_segments.pop_back();
+    empty->release();
+  }
+
+  HistorySegment *seg = create_segment(m_next_seq);
+  if (!seg) {
+    return false;
+  }
+  if (m_config.durability != HistoryConfig::BUFFERED) {
+    // the file's size and its directory entry have to survive too
+    fsync(seg->fd);
+    sync_dir();
+  }
+  if (!m_segments.empty()) {
+    m_segments.back()->sealed = time(nullptr);
+  }
+  m_segments.push_back(seg);
+  trim();
+  return true;
+}
+
+void RoomHistory::sync_dir() {
+  int fd = ::open(m_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+void RoomHistory::trim() {
+  size_t total = 0;
+  for (HistorySegment *seg : m_segments) {
+    total += seg->size;
+  }
+
+  // the newest segment always stays, it is the one taking appends
+  time_t now = time(nullptr);
+  while (m_segments.size() > 1) {
+    HistorySegment *oldest = m_segments.front();
+    bool too_big = m_config.retain_bytes && total > m_config.retain_bytes;
+    bool too_old = m_config.retain_secs && now - oldest->sealed > m_config.retain_secs;
+    if (!too_big && !too_old) {
+      break;
+    }
+    unlink(oldest->path.c_str()); // cursors still in it keep their mapping
+    total -= oldest->size;
+    m_segments.pop_front();
+    oldest->release();
+  }
+}
+
+uint64_t RoomHistory::append(const std::string &room, const std::string &sender,
+                             const char *text, size_t text_len, uint64_t &round) {
+  round = 0;
+  if (!bin_delivery_fits(room.size(), sender.size(), text_len)) {
+    return Frame::NO_SEQ; // no numbered receiver could be sent it either
+  }
+  size_t payload = 1 + room.size() + 1 + sender.size() + text_len;
+  size_t len = BIN_HEADER_LEN + payload;
+  size_t span = record_span(len);
+
+  if (m_config.retain_secs && m_segments.size() > 1
+      && time(nullptr) - m_segments.front()->sealed > m_config.retain_secs) {
+    trim();
+  }
+
+  if (m_segments.empty() || m_segments.back()->used + span > m_segments.back()->size) {
+    if (!rotate()) {
+      if (!m_failed) {
+        std::cerr << "[history] " << m_dir << ": can't add a segment, not keeping history\n";
+        m_failed = true;
+      }
+      return Frame::NO_SEQ;
+    }
+  }
+
+  HistorySegment *seg = m_segments.back();
+  char *rec = seg->base + seg->used;
+  char *p = bin_put_header(rec + RECORD_HEADER, BIN_DELIVERY, payload);
+  *p++ = static_cast<char>(room.size());
+  p = copy(p, room.data(), room.size());
+  *p++ = static_cast<char>(sender.size());
+  p = copy(p, sender.data(), sender.size());
+  copy(p, text, text_len);
+  bin_put_u32(rec + 4, checksum(rec + RECORD_HEADER, len));
+  bin_put_u32(rec, uint32_t(len)); // last, see the layout above
+
+  if (seg->count % INDEX_EVERY == 0) {
+    seg->index.push_back(uint32_t(seg->used));
+  }
+  seg->used += span;
+  seg->count++;
+  uint64_t seq = m_next_seq++;
+  m_failed = false;
+
+  if (m_config.durability == HistoryConfig::GROUP) {
+    round = HistoryFlusher::global().note_append(this, span);
+  } else if (m_config.durability == HistoryConfig::EACH) {
+    // just the pages the record is on
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = reinterpret_cast<uintptr_t>(rec) & ~(page - 1);
+    msync(reinterpret_cast<void *>(start), reinterpret_cast<uintptr_t>(rec) + span - start, MS_SYNC);
+  }
+  return seq;
+}
+
+void RoomHistory::commit() {
+  // every segment with records past the last commit, usually just the
+  // newest (or the one before it too, if it filled up meanwhile)
+  std::vector<HistorySegment *> dirty;
+  uint64_t target;
+  {
+    Guard g(m_lock);
+    target = m_next_seq;
+    for (auto it = m_segments.rbegin(); it != m_segments.rend(); ++it) {
+      if ((*it)->end_seq() <= m_synced_seq) {
+        break;
+      }
+      (*it)->pin();
+      dirty.push_back(*it);
+    }
+  }
+
+  // the pages were dirtied through the mapping, fdatasync writes them
+  // back all the same
+  for (HistorySegment *seg : dirty) {
+    if (fdatasync(seg->fd) < 0) {
+      std::cerr << "[history] " << seg->path << ": " << strerror(errno) << "\n";
+    }
+    seg->release();
+  }
+  HistoryFlusher::global().m_syncs += dirty.size();
+
+  Guard g(m_lock);
+  m_synced_seq = std::max(m_synced_seq, target);
+}
+
+uint64_t RoomHistory::seek(HistoryCursor &cur) {
+  Guard g(m_lock);
+  if (cur.pinned) {
+    cur.pinned->release();
+    cur.pinned = nullptr;
+  }
+
+  // the first segment with anything at or after next
+  auto it = std::upper_bound(m_segments.begin(), m_segments.end(), cur.next,
+                             [](uint64_t seq, const HistorySegment *seg) {
+                               return seq < seg->end_seq();
+                             });
+  uint64_t from = cur.next;
+  if (it == m_segments.end()) {
+    cur.next = cur.end; // all of it has been dropped
+    return cur.end - from;
+  }
+
+  HistorySegment *seg = *it;
+  cur.next = std::min(std::max(cur.next, seg->first_seq), cur.end);
+  if (cur.done()) {
+    return cur.next - from;
+  }
+
+  // jump to the closest indexed record, then walk
+  uint64_t k = cur.next - seg->first_seq;
+  size_t pos = seg->index[k / INDEX_EVERY];
+  for (k %= INDEX_EVERY; k > 0; k--) {
+    pos += record_span(bin_get_u32(seg->base + pos));
+  }
+
+  seg->pin();
+  cur.pinned = seg;
+  cur.pinned_end = std::min(cur.end, seg->end_seq());
+  cur.pos = pos;
+  return cur.next - from;
+}
+
+int RoomHistory::read(HistoryCursor &cur, struct iovec *iov, int max_iov, size_t max_bytes) {
+  if (cur.scratch.empty()) {
+    cur.scratch.resize(max_bytes + SCRATCH_SLACK);
+  }
+  char *scratch = cur.scratch.data();
+  size_t used = 0; // of scratch, never more than bytes
+  size_t bytes = 0;
+  int n = 0;
+
+  while (n < max_iov && bytes < max_bytes && !cur.done()) {
+    if (!cur.pinned || cur.next >= cur.pinned_end) {
+      if (n > 0) {
+        break; // what we have may point into the pinned segment
+      }
+      uint64_t skipped = seek(cur);
+      if (skipped && cur.report_gap) {
+        char *p = scratch + used;
+        if (cur.format == User::TEXT) {
+          p += sprintf(p, TAG_MISSED ":%u\n", unsigned(std::min<uint64_t>(skipped, UINT32_MAX)));
+        } else {
+          p = bin_put_u32(bin_put_header(p, BIN_MISSED, 4), uint32_t(std::min<uint64_t>(skipped, UINT32_MAX)));
+        }
+        iov[n].iov_base = scratch + used;
+        iov[n].iov_len = p - (scratch + used);
+        used += iov[n].iov_len;
+        bytes += iov[n++].iov_len;
+      }
+      continue;
+    }
+
+    const char *rec = cur.pinned->base + cur.pos;
+    const char *frame = rec + RECORD_HEADER;
+    size_t len = bin_get_u32(rec);
+
+    if (cur.format == User::BINARY) {
+      // as is, from the mapped page
+      iov[n].iov_base = const_cast<char *>(frame);
+      iov[n].iov_len = len;
+      bytes += iov[n++].iov_len;
+    } else {
+      // take the fields back out of the binary delivery
+      const char *room = frame + BIN_HEADER_LEN + 1;
+      size_t room_len = uint8_t(room[-1]);
+      const char *sender = room + room_len + 1;
+      size_t sender_len = uint8_t(sender[-1]);
+      const char *text = sender + sender_len;
+      size_t text_len = frame + len - text;
+
+      char *start = scratch + used;
+      char *p = start;
+      if (cur.format == User::TEXT) {
+        // the same rule as live deliveries: skip what a line can't carry
+        size_t line_len = sizeof(TAG_DELIVERY) + room_len + 1 + sender_len + 1 + text_len + 1;
+        if (line_len <= Message::MAX_LEN && !memchr(text, '\n', text_len)) {
+          p = copy(p, TAG_DELIVERY ":", sizeof(TAG_DELIVERY));
+          p = copy(p, room, room_len);
+          *p++ = ':';
+          p = copy(p, sender, sender_len);
+          *p++ = ':';
+          p = copy(p, text, text_len);
+          *p++ = '\n';
+        }
+      } else {
+        // the names the live path sends at join may still be queued
+        // behind us, so the replay announces its own
+        if (cur.named.empty()) {
+          cur.named.insert(cur.room_id);
+          p = put_name_frame(p, cur.room_id, room, room_len);
+        }
+        if (cur.last_sender_id == UINT32_MAX || cur.last_sender.size() != sender_len
+            || memcmp(cur.last_sender.data(), sender, sender_len) != 0) {
+          cur.last_sender.assign(sender, sender_len);
+          cur.last_sender_id = InternTable::global().intern(cur.last_sender);
+          if (cur.last_sender_id != InternTable::NO_ID
+              && cur.named.insert(cur.last_sender_id).second) {
+            p = put_name_frame(p, cur.last_sender_id, sender, sender_len);
+          }
+        }
+        // (skipped if the name table is too full to give the sender an ID)
+        if (cur.last_sender_id != InternTable::NO_ID) {
+          p = bin_put_header(p, BIN_DELIVERY_ID, 8 + text_len);
+          p = bin_put_u32(p, cur.room_id);
+          p = bin_put_u32(p, cur.last_sender_id);
+          p = copy(p, text, text_len);
+        }
+      }
+
+      if (p > start) {
+        iov[n].iov_base = start;
+        iov[n].iov_len = p - start;
+        used += iov[n].iov_len;
+        bytes += iov[n++].iov_len;
+      }
+    }
+
+    cur.pos += record_span(len);
+    cur.next++;
+  }
+
+  return n;
+}
+
+HistoryFlusher &HistoryFlusher::global() {
+  static HistoryFlusher flusher;
+  return flusher;
+}
+
+HistoryFlusher::HistoryFlusher()
+  : m_commit_ms(0)
+  , m_commit_bytes(0)
+  , m_running(false)
+  , m_pending_bytes(0)
+  , m_open(1)
+  , m_completed(0)
+  , m_rounds(0)
+  , m_syncs(0)
+  , m_appends(0) {
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m_work, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&m_done, nullptr);
+  m_round_start.tv_sec = m_round_start.tv_nsec = 0;
+}
+
+HistoryFlusher::~HistoryFlusher() {
+  // only at exit, with the thread (if any) still blocked in run
+}
+
+bool HistoryFlusher::start(const HistoryConfig &config) {
+  m_commit_ms = config.commit_ms;
+  m_commit_bytes = config.commit_bytes;
+
+  pthread_t tid;
+  if (pthread_create(&tid, nullptr, thread_main, this) != 0) {
+    return false;
+  }
+  pthread_detach(tid);
+  m_running = true;
+  return true;
+}
+
+void *HistoryFlusher::thread_main(void *arg) {
+  static_cast<HistoryFlusher *>(arg)->run();
+  return nullptr;
+}
+
+void HistoryFlusher::add_listener(NotifyFn fn, void *arg) {
+  Guard g(m_lock);
+  m_listeners.push_back(std::make_pair(fn, arg));
+}
+
+uint64_t HistoryFlusher::note_append(RoomHistory *history, size_t bytes) {
+  Guard g(m_lock);
+  if (m_dirty.empty()) {
+    clock_gettime(CLOCK_MONOTONIC, &m_round_start);
+    pthread_cond_signal(&m_work);
+  }
+  if (!history->m_flush_queued) {
+    history->m_flush_queued = true;
+    m_dirty.push_back(history);
+  }
+  size_t before = m_pending_bytes;
+  m_pending_bytes += bytes;
+  if (before < m_commit_bytes && m_pending_bytes >= m_commit_bytes) {
+    pthread_cond_signal(&m_work); // full, no need to wait out commit_ms
+  }
+  m_appends.fetch_add(1, std::memory_order_relaxed);
+  return m_open;
+}
+
+void HistoryFlusher::wait_for(uint64_t round) {
+  if (completed() >= round) {
+    return;
+  }
+  Guard g(m_lock);
+  while (m_completed.load() < round) {
+    pthread_cond_wait(&m_done, &m_lock);
+  }
+}
+
+void HistoryFlusher::run() {
+  while (true) {
+    std::vector<RoomHistory *> dirty;
+    std::vector<std::pair<NotifyFn, void *> > listeners;
+    uint64_t round;
+    {
+      Guard g(m_lock);
+      while (m_dirty.empty()) {
+        pthread_cond_wait(&m_work, &m_lock);
+      }
+
+      // let the round fill up, for commit_ms after its first append
+      struct timespec deadline = m_round_start;
+      deadline.tv_nsec += long(m_commit_ms) * 1000000;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while (m_pending_bytes < m_commit_bytes
+             && pthread_cond_timedwait(&m_work, &m_lock, &deadline) != ETIMEDOUT) {
+      }
+
+      // appends from here on are in the next round
+      dirty.swap(m_dirty);
+      for (RoomHistory *history : dirty) {
+        history->m_flush_queued = false;
+      }
+      m_pending_bytes = 0;
+      round = m_open++;
+      listeners = m_listeners;
+    }
+
+    // each history's appends so far, which includes all of this round's
+    for (RoomHistory *history : dirty) {
+      history->commit();
+    }
+
+    {
+      Guard g(m_lock);
+      m_completed.store(round, std::memory_order_release);
+      pthread_cond_broadcast(&m_done);
+    }
+    m_rounds++;
+    for (auto &l : listeners) {
+      l.first(l.second);
+    }
+  }
+}
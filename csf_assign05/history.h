@@ -0,0 +1,219 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "user.h"
+
+// Where room history is kept and how much of it (-D), off unless dir
+// is set. Each room gets a subdirectory of dir.
+struct HistoryConfig {
+  // when a sender's OK for sendall may go out (-f)
+  enum Durability {
+    BUFFERED, // right away, the kernel writes the pages back when it likes
+    GROUP,    // once a HistoryFlusher round has synced the message
+    EACH,     // right away, after syncing the message by itself
+  };
+
+  std::string dir;
+  size_t segment_bytes; // every segment file is preallocated to this size
+  size_t retain_bytes;  // per room, the oldest segments go first (0: no limit)
+  long retain_secs;     // segments sealed longer ago than this go (0: no limit)
+  Durability durability;
+  int commit_ms;        // GROUP: a round waits at most this long to fill up
+                        // (0: it takes what came in during the last sync)...
+  size_t commit_bytes;  // ...or until this much has been appended
+
+  HistoryConfig()
+    : segment_bytes(4 << 20), retain_bytes(0), retain_secs(0)
+    , durability(BUFFERED), commit_ms(0), commit_bytes(1 << 20) { }
+};
+
+class RoomHistory;
+struct HistorySegment;
+
+// A receiver's place in a replay: the deliveries numbered [next, end)
+// are streamed to it before anything live (end is where the live
+// deliveries took over, see Room::add_member). Only RoomHistory::read
+// touches the rest.
+struct HistoryCursor {
+  RoomHistory *history;
+  uint64_t next;
+  uint64_t end;
+  User::Format format;
+  uint32_t room_id;
+  bool report_gap; // send "missed:N" for history that was already dropped
+
+  HistorySegment *pinned; // the segment next is in, kept mapped for us
+  uint64_t pinned_end;    // where our part of it ends
+  size_t pos;             // next's record in it
+
+  std::vector<char> scratch; // deliveries re-encoded for text and irlogin receivers
+  std::unordered_set<uint32_t> named; // IDs announced so far (irlogin)
+  std::string last_sender;            // ...and the last sender looked up
+  uint32_t last_sender_id;
+
+  HistoryCursor(RoomHistory *history, uint64_t next, uint64_t end,
+                User::Format format, uint32_t room_id, bool report_gap);
+  ~HistoryCursor();
+
+  bool done() const { return next >= end; }
+
+private:
+  // value semantics prohibited
+  HistoryCursor(const HistoryCursor &);
+  HistoryCursor &operator=(const HistoryCursor &);
+};
+
+// A RoomHistory is a room's broadcasts on disk. Every broadcast is
+// appended as a record holding its binary delivery frame (binproto.h)
+// to the newest of a series of segment files, each preallocated and
+// memory-mapped, so an append is a copy into the page cache. Records
+// are numbered from 0 for the life of the room (across restarts), and
+// each segment keeps a small index of every INDEX_EVERY'th record, so
+// finding a sequence number is a binary search over the segments and
+// a short walk.
+//
+// When the newest segment is full a new one takes over, and the oldest
+// are deleted by size or age. A segment that is still being replayed
+// from stays mapped until the reader moves on.
+class RoomHistory {
+public:
+  // open room_name's history under config.dir, creating it or picking
+  // up where it left off (a torn record at the end is cut off);
+  // nullptr, after saying why, if that fails
+  static RoomHistory *open(const HistoryConfig &config, const std::string &room_name);
+  ~RoomHistory();
+
+  // a room appends and fans out each broadcast under this lock, and
+  // joins take their place in the sequence under it
+  pthread_mutex_t &lock() { return m_lock; }
+
+  // lock() must be held for these. append returns the record's
+  // sequence number, or Frame::NO_SEQ (nothing is written) if a new
+  // segment can't be created or the delivery doesn't fit a numbered
+  // binary frame (bin_delivery_fits). In GROUP mode round is set to
+  // the HistoryFlusher round that will make the record durable,
+  // otherwise to 0 (nothing to wait for).
+  uint64_t append(const std::string &room, const std::string &sender,
+                  const char *text, size_t text_len, uint64_t &round);
+  uint64_t next_seq() const { return m_next_seq; }
+
+  // whether senders are told their messages are on disk (-f group|each),
+  // so a failed append has to be reported rather than shrugged off
+  bool durable() const { return m_config.durability != HistoryConfig::BUFFERED; }
+
+  // the next part of cur's replay, as up to max_iov pieces (about
+  // max_bytes) to be written out in order. Binary deliveries point
+  // straight into the mapped segment, other formats are encoded into
+  // cur's scratch buffer; either way the pieces stay valid until the
+  // next call. 0 once the replay is done.
+  int read(HistoryCursor &cur, struct iovec *iov, int max_iov, size_t max_bytes);
+
+private:
+  friend class HistoryFlusher;
+
+  RoomHistory(const HistoryConfig &config, const std::string &dir);
+
+  // value semantics prohibited
+  RoomHistory(const RoomHistory &);
+  RoomHistory &operator=(const RoomHistory &);
+
+  static const uint64_t INDEX_EVERY = 64;
+
+  bool load();
+  HistorySegment *load_segment(const std::string &path);
+  HistorySegment *create_segment(uint64_t first_seq);
+  bool rotate();
+  void trim(); // retention
+  void sync_dir();
+
+  // GROUP: sync every segment written to since the last commit (called
+  // by the flusher, without the lock)
+  void commit();
+
+  // pin the segment cur.next is in (skipping what was dropped),
+  // returns how many deliveries were skipped
+  uint64_t seek(HistoryCursor &cur);
+
+  HistoryConfig m_config;
+  std::string m_dir;
+  pthread_mutex_t m_lock;
+  std::deque<HistorySegment *> m_segments; // oldest first, the last takes appends
+  uint64_t m_next_seq;
+  uint64_t m_synced_seq; // GROUP: records before this are on disk
+  bool m_flush_queued;   // GROUP: on the flusher's list (its lock guards this)
+  bool m_failed; // an append has failed (reported once)
+};
+
+// The group commit thread (-f group). Appends in every room join the
+// current round, and a round is closed once it has waited commit_ms or
+// collected commit_bytes, whichever comes first; it then costs one
+// fdatasync per segment written to, however many messages it covers.
+// Senders wait for the round their message is in (wait_for), or, if
+// they can't block, register to be told whenever a round completes.
+class HistoryFlusher {
+public:
+  static HistoryFlusher &global();
+
+  bool start(const HistoryConfig &config);
+  bool running() const { return m_running; }
+
+  // rounds are numbered from 1, everything appended in rounds up to
+  // completed() is on disk
+  uint64_t completed() const { return m_completed.load(std::memory_order_acquire); }
+  void wait_for(uint64_t round);
+
+  // fn(arg) is called (on the flusher thread) after every round
+  typedef void (*NotifyFn)(void *arg);
+  void add_listener(NotifyFn fn, void *arg);
+
+  unsigned long rounds() const { return m_rounds.load(); }
+  unsigned long syncs() const { return m_syncs.load(); }
+  unsigned long appends() const { return m_appends.load(); }
+
+private:
+  friend class RoomHistory;
+
+  HistoryFlusher();
+  ~HistoryFlusher();
+
+  // value semantics prohibited
+  HistoryFlusher(const HistoryFlusher &);
+  HistoryFlusher &operator=(const HistoryFlusher &);
+
+  static void *thread_main(void *arg);
+  void run();
+
+  // a record of bytes was appended to history (whose lock is held),
+  // returns the round it is in
+  uint64_t note_append(RoomHistory *history, size_t bytes);
+
+  int m_commit_ms;
+  size_t m_commit_bytes;
+  bool m_running;
+
+  pthread_mutex_t m_lock; // guards everything but the atomics
+  pthread_cond_t m_work;  // something to commit, or a round filled up
+  pthread_cond_t m_done;  // a round completed
+  std::vector<RoomHistory *> m_dirty; // appended to in the open round
+  size_t m_pending_bytes;
+  struct timespec m_round_start;      // of the open round's first append
+  uint64_t m_open;                    // the round appends join
+  std::atomic<uint64_t> m_completed;
+  std::vector<std::pair<NotifyFn, void *> > m_listeners;
+
+  std::atomic<unsigned long> m_rounds;
+  std::atomic<unsigned long> m_syncs;
+  std::atomic<unsigned long> m_appends;
+};
+
+#endif // HISTORY_H
@@ -0,0 +1,54 @@
+#include "intern.h"
+
+InternTable::InternTable()
+  : m_count(0) {
+  pthread_rwlock_init(&m_lock, nullptr);
+  for (uint32_t i = 0; i < MAX_CHUNKS; i++) {
+    m_chunks[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+InternTable::~InternTable() {
+  for (uint32_t i = 0; i < MAX_CHUNKS; i++) {
+    delete[] m_chunks[i].load();
+  }
+  pthread_rwlock_destroy(&m_lock);
+}
+
+InternTable &InternTable::global() {
+  static InternTable table;
+  return table;
+}
+
+uint32_t InternTable::intern(const std::string &name) {
+  // the common case: we've seen the name before
+  pthread_rwlock_rdlock(&m_lock);
+  auto it = m_ids.find(name);
+  bool found = (it != m_ids.end());
+  uint32_t id = found ? it->second : 0;
+  pthread_rwlock_unlock(&m_lock);
+  if (found) {
+    return id;
+  }
+
+  pthread_rwlock_wrlock(&m_lock);
+  it = m_ids.find(name);
+  if (it != m_ids.end()) {
+    id = it->second; // someone else added it in the meantime
+  } else if (m_count == CHUNK_SIZE * MAX_CHUNKS) {
+    id = NO_ID; // full, the caller turns the name away
+  } else {
+    id = m_count++;
+    std::string *chunk = m_chunks[id / CHUNK_SIZE].load(std::memory_order_relaxed);
+    if (!chunk) {
+      chunk = new std::string[CHUNK_SIZE];
+    }
+    chunk[id % CHUNK_SIZE] = name;
+    // publishes the name along with the chunk (the id itself reaches
+    // other threads through whatever they use to share it)
+    m_chunks[id / CHUNK_SIZE].store(chunk, std::memory_order_release);
+    m_ids.emplace(name, id);
+  }
+  pthread_rwlock_unlock(&m_lock);
+  return id;
+}
@@ -0,0 +1,54 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <string>
+#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+
+// An InternTable gives every distinct name (room names and usernames
+// share one table) a small integer ID, so the delivery path can carry
+// and compare IDs instead of strings. IDs are handed out densely from
+// 0 and names are never removed, so name() is just two array loads
+// and takes no lock. Looking a name up takes a shared lock, adding one
+// the exclusive lock.
+//
+// Since nothing is ever removed, the server only interns the names
+// deliveries carry: rooms, and users once they join a room as senders.
+// Receivers (however many come and go) don't take up entries.
+class InternTable {
+public:
+  InternTable();
+  ~InternTable();
+
+  // the table used by the server
+  static InternTable &global();
+
+  // what intern returns once the table is full
+  static const uint32_t NO_ID = UINT32_MAX;
+
+  uint32_t intern(const std::string &name);
+
+  // id must have come from intern (and not be NO_ID), the reference stays valid forever
+  const std::string &name(uint32_t id) const {
+    return m_chunks[id / CHUNK_SIZE].load(std::memory_order_acquire)[id % CHUNK_SIZE];
+  }
+
+private:
+  // value semantics prohibited
+  InternTable(const InternTable &);
+  InternTable &operator=(const InternTable &);
+
+  // names live in fixed size chunks that never move, so readers don't
+  // race with the table growing
+  static const uint32_t CHUNK_SIZE = 4096;
+  static const uint32_t MAX_CHUNKS = 4096;
+
+  pthread_rwlock_t m_lock;
+  std::unordered_map<std::string, uint32_t> m_ids;
+  uint32_t m_count;
+  std::atomic<std::string *> m_chunks[MAX_CHUNKS];
+};
+
+#endif // INTERN_H
@@ -0,0 +1,128 @@
+#include "linescan.h"
+
+#ifdef __x86_64__ // SSE2 is part of the baseline ISA there
+#include <immintrin.h>
+#define LINESCAN_X86 1
+#endif
+
+// the scalar loops also finish off the last partial vector
+static size_t scan_tail(const char *buf, size_t pos, size_t len,
+                        uint32_t *ends, size_t found, size_t max) {
+  for (; pos < len && found < max; pos++) {
+    if (buf[pos] == '\n') {
+      ends[found++] = pos + 1;
+    }
+  }
+  return found;
+}
+
+size_t scan_lines_scalar(const char *buf, size_t len, uint32_t *ends, size_t max) {
+  return scan_tail(buf, 0, len, ends, 0, max);
+}
+
+const char *find_newline_scalar(const char *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (buf[i] == '\n') {
+      return buf + i;
+    }
+  }
+  return nullptr;
+}
+
+#ifdef LINESCAN_X86
+
+// one bit per byte of the block that is a newline
+static size_t drain_mask(unsigned mask, size_t base,
+                         uint32_t *ends, size_t found, size_t max) {
+  while (mask && found < max) {
+    ends[found++] = base + __builtin_ctz(mask) + 1;
+    mask &= mask - 1;
+  }
+  return found;
+}
+
+static size_t scan_lines_sse2(const char *buf, size_t len, uint32_t *ends, size_t max) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t found = 0, i = 0;
+  for (; i + 16 <= len && found < max; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    found = drain_mask(mask, i, ends, found, max);
+  }
+  return scan_tail(buf, i, len, ends, found, max);
+}
+
+static const char *find_newline_sse2(const char *buf, size_t len) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if (mask) {
+      return buf + i + __builtin_ctz(mask);
+    }
+  }
+  return find_newline_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_lines_avx2(const char *buf, size_t len, uint32_t *ends, size_t max) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t found = 0, i = 0;
+  for (; i + 32 <= len && found < max; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    found = drain_mask(mask, i, ends, found, max);
+  }
+  return scan_tail(buf, i, len, ends, found, max);
+}
+
+__attribute__((target("avx2")))
+static const char *find_newline_avx2(const char *buf, size_t len) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    if (mask) {
+      return buf + i + __builtin_ctz(mask);
+    }
+  }
+  return find_newline_sse2(buf + i, len - i);
+}
+
+static bool have_avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static const bool s_avx2 = have_avx2();
+
+size_t scan_lines(const char *buf, size_t len, uint32_t *ends, size_t max) {
+  return s_avx2 ? scan_lines_avx2(buf, len, ends, max)
+                : scan_lines_sse2(buf, len, ends, max);
+}
+
+const char *find_newline(const char *buf, size_t len) {
+  return s_avx2 ? find_newline_avx2(buf, len) : find_newline_sse2(buf, len);
+}
+
+const char *scan_lines_impl() {
+  return s_avx2 ? "avx2" : "sse2";
+}
+
+#else
+
+size_t scan_lines(const char *buf, size_t len, uint32_t *ends, size_t max) {
+  return scan_lines_scalar(buf, len, ends, max);
+}
+
+const char *find_newline(const char *buf, size_t len) {
+  return find_newline_scalar(buf, len);
+}
+
+const char *scan_lines_impl() {
+  return "scalar";
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef LINESCAN_H
+#define LINESCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Newline scanning for the line readers (Connection and the event
+// loops). Instead of looking at one byte at a time these compare 16
+// (SSE2) or 32 (AVX2) bytes per instruction and pull every newline
+// out of the resulting bitmask, so a whole read buffer's worth of
+// lines is found in one pass. AVX2 is picked at runtime when the CPU
+// has it, and non-x86 builds get the plain scalar loop.
+
+// Record the offset just past each of the first max newlines in
+// buf[0, len) into ends, returning how many were found.
+size_t scan_lines(const char *buf, size_t len, uint32_t *ends, size_t max);
+
+// first newline in buf[0, len), or nullptr
+const char *find_newline(const char *buf, size_t len);
+
+// the byte-at-a-time versions, kept for non-x86 and for bench_linescan
+size_t scan_lines_scalar(const char *buf, size_t len, uint32_t *ends, size_t max);
+const char *find_newline_scalar(const char *buf, size_t len);
+
+// name of the implementation scan_lines uses ("avx2", "sse2" or "scalar")
+const char *scan_lines_impl();
+
+#endif // LINESCAN_H
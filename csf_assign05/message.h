@@ -3,7 +3,50 @@
 
 #include <vector>
 #include <string>
-#include <sstream>
+#include <cstring>
+
+struct Message;
+
+// A MessageView is a decoded tag:data line that still points into the
+// buffer it was parsed from (e.g. a Connection's read buffer), so
+// decoding it copies nothing. It is only valid until that buffer is
+// reused; call to_message() to keep it.
+struct MessageView {
+  const char *tag;
+  size_t tag_len;
+  const char *data;
+  size_t data_len;
+
+  MessageView() : tag(""), tag_len(0), data(""), data_len(0) { }
+
+  // split a raw line at the first ':' and drop any trailing
+  // newline or carriage return characters from the data
+  bool decode(const char *raw, size_t len) {
+    const char *sep = static_cast<const char *>(memchr(raw, ':', len));
+    if (!sep) { // not found so invalid :(
+      return false;
+    }
+
+    tag = raw;
+    tag_len = sep - raw;
+    data = sep + 1;
+    data_len = len - tag_len - 1;
+
+    while (data_len > 0 && (data[data_len - 1] == '\n' || data[data_len - 1] == '\r')) {
+      data_len--;
+    }
+    return true;
+  }
+
+  // compare the tag with one of the TAG_ constants below
+  bool tag_is(const char *t) const {
+    return strlen(t) == tag_len && memcmp(t, tag, tag_len) == 0;
+  }
+
+  std::string data_str() const { return std::string(data, data_len); }
+
+  inline Message to_message() const;
+};
 
 struct Message {
   // An encoded message may have at most this many characters,
@@ -20,34 +63,66 @@ struct Message {
   Message(const std::string &tag, const std::string &data)
     : tag(tag), data(data) { }
 
+  // length of the encoded line, including the newline
+  size_t encoded_len() const { return tag.size() + 1 + data.size() + 1; }
+
+  // write the encoded line to buf, which must have room for
+  // encoded_len() bytes, and return the end of what was written
+  char *encode_to(char *buf) const {
+    memcpy(buf, tag.data(), tag.size());
+    buf += tag.size();
+    *buf++ = ':';
+    memcpy(buf, data.data(), data.size());
+    buf += data.size();
+    *buf++ = '\n';
+    return buf;
+  }
+
+  // append the encoded line to out, whose capacity is reused
+  void encode_append(std::string &out) const {
+    size_t pos = out.size();
+    out.resize(pos + encoded_len());
+    encode_to(&out[pos]);
+  }
+
   // should convert Message into specific format
   std::string encode() const {
-    std::ostringstream oss;
-    oss << tag << ":" << data << "\n"; // write tag:data into string builder oss made
-    return oss.str(); // return ts msg
+    std::string out;
+    encode_append(out);
+    return out;
+  }
+
+  // refill tag and data in place, so a Message kept around for replies
+  // stops allocating once its strings have grown big enough
+  void set(const char *t, const char *d, size_t d_len) {
+    tag.assign(t);
+    data.assign(d, d_len);
   }
+  void set(const char *t, const char *d) { set(t, d, strlen(d)); }
 
   // should parse raw input line into Message obj to decode
   bool decode(const std::string &raw) {
-    // to find first : separator (found between tag:data)
-    size_t sep = raw.find(':');
-    if (sep == std::string::npos) { // not found so invalid :(
+    MessageView view;
+    if (!view.decode(raw.data(), raw.size())) {
       return false;
     }
-
-    // here split string into this tag:data format
-    tag = raw.substr(0, sep);
-    data = raw.substr(sep + 1);
-
-    // to remove maybe possible newline or carriage retrun chars
-    while (!data.empty() && (data.back() == '\n' || data.back() == '\r')) {
-      data.pop_back();
-    }
-
+    assign(view);
     return true; // successful decoding
   }
+
+  // copy a view's tag and data (reusing our strings' storage)
+  void assign(const MessageView &view) {
+    tag.assign(view.tag, view.tag_len);
+    data.assign(view.data, view.data_len);
+  }
 };
 
+inline Message MessageView::to_message() const {
+  Message msg;
+  msg.assign(*this);
+  return msg;
+}
+
 // standard message tags (note that you don't need to worry about
 // "senduser" or "empty" messages)
 #define TAG_ERR       "err"       // protocol error
@@ -55,11 +130,17 @@ struct Message {
 #define TAG_SLOGIN    "slogin"    // register as specific user for sending
 #define TAG_RLOGIN    "rlogin"    // register as specific user for receiving
 #define TAG_JOIN      "join"      // join a chat room
+#define TAG_JOIN_LAST "joinlast"  // N:room, join and get the room's last N messages first
+#define TAG_JOIN_SINCE "joinsince" // SEQ:room, join and get the room's messages from SEQ on first
+#define TAG_JOIN_SEQ  "sjoin"     // join a chat room, with deliveries stamped by sequence number
+#define TAG_RESUME    "resume"    // SEQ:room, sjoin and first get what came after SEQ (the last one seen)
 #define TAG_LEAVE     "leave"     // leave a chat room
 #define TAG_SENDALL   "sendall"   // send message to all users in chat room
 #define TAG_SENDUSER  "senduser"  // send message to specific user in chat room
 #define TAG_QUIT      "quit"      // quit
 #define TAG_DELIVERY  "delivery"  // message delivered by server to receiving client
+#define TAG_DELIVERY_SEQ "sdelivery" // SEQ:room:sender:text, a delivery after sjoin/resume
 #define TAG_EMPTY     "empty"     // sent by server to receiving client to indicate no msgs available
+#define TAG_MISSED    "missed"    // sent to a receiver in place of N deliveries its queue had no room for
 
 #endif // MESSAGE_H
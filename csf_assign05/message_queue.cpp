@@ -1,56 +1,498 @@
 #include <cassert>
-#include <ctime>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <new>
+#include <algorithm>
+#include "frame.h"
+#include "pool.h"
 #include "message_queue.h"
-#include "guard.h"
 
+namespace {
 
-MessageQueue::MessageQueue() {
-  // TODO: initialize the mutex and the semaphore
-  pthread_mutex_init(&m_lock, nullptr);
-  sem_init(&m_avail, 0, 0); // semaphore for count of messages
+// SPILL: frames written per pwritev, and how much is read back at once
+const size_t SPILL_BATCH = 64;
+const size_t SPILL_CHUNK = 64 * 1024;
+
+}
+
+BlockPool MessageQueue::s_node_pool(sizeof(Node));
+QueueStats MessageQueue::s_stats;
+
+MessageQueue::MessageQueue()
+  : m_head(&m_stub)
+  , m_tail(&m_stub)
+  , m_sleeping(0)
+  , m_wakefd(-1)
+  , m_poked(false)
+  , m_notify(nullptr)
+  , m_notify_arg(nullptr)
+  , m_count(0)
+  , m_bytes(0)
+  , m_sockfd(-1)
+  , m_binary(false)
+  , m_popping(false)
+  , m_overflowed(false)
+  , m_gap_queued(false)
+  , m_missed(0)
+  , m_spillfd(-1)
+  , m_spill_end(0)
+  , m_spill_pos(0)
+  , m_spill_off(0)
+  , m_spilled(0) {
+  m_stub.next.store(nullptr, std::memory_order_relaxed);
+  m_stub.frame = nullptr;
 }
 
 MessageQueue::~MessageQueue() {
-  pthread_mutex_destroy(&m_lock);
-  sem_destroy(&m_avail);
-}
-
-void MessageQueue::enqueue(Message *msg) {
-  // TODO: put the specified message on the queue
-  //Guard g(m_lock);
-  pthread_mutex_lock(&m_lock);
-  m_messages.push_back(msg); // push new msg
-  pthread_mutex_unlock(&m_lock);
-  sem_post(&m_avail); // notify waiting threads
-  // be sure to notify any thread waiting for a message to be
-  // available by calling sem_post
-}
-
-Message *MessageQueue::dequeue() {
-  struct timespec ts;
-
-  // get the current time using clock_gettime:
-  // we don't check the return value because the only reason
-  // this call would fail is if we specify a clock that doesn't
-  // exist
-  clock_gettime(CLOCK_REALTIME, &ts);
-  
-  // compute a time one second in the future
-  ts.tv_sec += 1;
-
-  // TODO: call sem_timedwait to wait up to 1 second for a message
-  //       to be available, return nullptr if no message is available
-  if (sem_timedwait(&m_avail, &ts) != 0) {
-    return nullptr; // timeout, no message
-  }
-
-  // TODO: remove the next message from the queue, return it
-  
-  //Guard g(m_lock);
-  //if (m_messages.empty()) return nullptr;
-  pthread_mutex_lock(&m_lock);
-  Message *msg = m_messages.front();
-  m_messages.pop_front();
-  pthread_mutex_unlock(&m_lock);
-  return msg;
-}
\ No newline at end of file
+  // queued frames that were never delivered belong to us
+  Frame *frame;
+  while (pop(frame) == POPPED) {
+    if (frame) {
+      frame->release();
+    }
+  }
+
+  if (m_wakefd >= 0) {
+    close(m_wakefd);
+  }
+  if (m_spillfd >= 0) {
+    close(m_spillfd); // it was unlinked when it was made
+  }
+}
+
+void MessageQueue::push(Node *node) {
+  node->next.store(nullptr, std::memory_order_relaxed);
+  Node *prev = m_head.exchange(node); // serializes producers
+  prev->next.store(node, std::memory_order_release);
+}
+
+MessageQueue::PopResult MessageQueue::pop(Frame *&frame) {
+  Node *tail = m_tail;
+  Node *next = tail->next.load(std::memory_order_acquire);
+
+  if (tail == &m_stub) {
+    if (!next) {
+      return (m_head.load() == tail) ? EMPTY : BUSY;
+    }
+    m_tail = next; // skip over the stub
+    tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+
+  if (!next) {
+    if (tail != m_head.load()) {
+      return BUSY; // a producer has swung m_head but not linked yet
+    }
+    // tail is the last node: put the stub behind it so it can be taken
+    push(&m_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (!next) {
+      return BUSY;
+    }
+  }
+
+  m_tail = next;
+  frame = tail->frame;
+  tail->~Node();
+  s_node_pool.free(tail);
+  if (frame) {
+    m_count.fetch_sub(1, std::memory_order_relaxed);
+    m_bytes.fetch_sub(frame->size(), std::memory_order_relaxed);
+  }
+  return POPPED;
+}
+
+MessageQueue::PopResult MessageQueue::take(Frame *&frame) {
+  bool lock = (m_limits.policy == QueueLimits::DROP_OLDEST
+               || m_limits.policy == QueueLimits::SPILL);
+
+  while (true) {
+    if (lock) {
+      while (m_popping.exchange(true, std::memory_order_acquire)) {
+        sched_yield(); // a producer is trimming, it won't be long
+      }
+    }
+    // whatever was spilled is older than anything still in the list
+    PopResult r = POPPED;
+    if (m_spilled.load(std::memory_order_relaxed) == 0 || !(frame = read_spill())) {
+      r = pop(frame);
+    }
+    if (lock) {
+      m_popping.store(false, std::memory_order_release);
+    }
+    if (r != POPPED || frame) {
+      return r;
+    }
+
+    // a gap node: report everything dropped up to now (anything
+    // dropped after the flag is cleared queues a new gap node)
+    m_gap_queued.store(false);
+    uint32_t missed = m_missed.exchange(0);
+    if (missed > 0) {
+      frame = Frame::make_missed(missed, m_binary);
+      s_stats.gap_markers++;
+      return POPPED;
+    }
+  }
+}
+
+// shift scales the limits down, by half for 1
+bool MessageQueue::over_limits(size_t frame_size, int shift) const {
+  size_t extra = frame_size ? 1 : 0;
+  return (m_limits.max_frames
+          && m_count.load(std::memory_order_relaxed) + extra > (m_limits.max_frames >> shift))
+    || (m_limits.max_bytes
+        && m_bytes.load(std::memory_order_relaxed) + frame_size > (m_limits.max_bytes >> shift));
+}
+
+void MessageQueue::overflow(Frame *frame) {
+  frame->release(); // every policy but DROP_OLDEST and SPILL drops the new one
+
+  switch (m_limits.policy) {
+  case QueueLimits::MARK_GAP:
+    m_missed.fetch_add(1);
+    if (!m_gap_queued.exchange(true)) {
+      // where the marker goes: one gap node however much is dropped
+      Node *node = new (s_node_pool.alloc()) Node;
+      node->frame = nullptr;
+      push(node);
+      wake();
+    }
+    // fall through
+  case QueueLimits::DROP_NEWEST:
+    s_stats.dropped_newest++;
+    break;
+  case QueueLimits::DISCONNECT:
+    s_stats.dropped_cut++;
+    cut_off();
+    break;
+  case QueueLimits::DROP_OLDEST:
+  case QueueLimits::SPILL:
+    break;
+  }
+}
+
+void MessageQueue::cut_off() {
+  if (!m_overflowed.exchange(true)) {
+    s_stats.disconnects++;
+    // the receiver's thread or event loop sees the socket go away
+    // and ends the session as if the client had hung up
+    if (m_sockfd >= 0) {
+      shutdown(m_sockfd, SHUT_RDWR);
+    }
+  }
+}
+
+void MessageQueue::trim() {
+  if (m_popping.exchange(true, std::memory_order_acquire)) {
+    return; // the consumer (or another producer) is popping already
+  }
+  Frame *frame;
+  while (over_limits(0) && pop(frame) == POPPED) {
+    frame->release();
+    s_stats.dropped_oldest++;
+  }
+  m_popping.store(false, std::memory_order_release);
+}
+
+void MessageQueue::spill() {
+  if (m_popping.exchange(true, std::memory_order_acquire)) {
+    return; // the consumer (or another producer) is popping already
+  }
+  // down to half the limits, so a receiver that stays behind costs a
+  // write per batch of deliveries rather than one per delivery
+  Frame *batch[SPILL_BATCH];
+  while (over_limits(0, 1) && !m_overflowed.load()) {
+    size_t n = 0;
+    while (n < SPILL_BATCH && over_limits(0, 1) && pop(batch[n]) == POPPED) {
+      n++;
+    }
+    if (n == 0) {
+      break;
+    }
+    bool ok = write_spill(batch, n);
+    for (size_t i = 0; i < n; i++) {
+      batch[i]->release();
+    }
+    if (!ok) {
+      // nowhere to put them: cut the receiver off rather than lose
+      // deliveries without telling it
+      s_stats.dropped_cut += n;
+      cut_off();
+      break;
+    }
+    m_spilled.fetch_add(n, std::memory_order_relaxed);
+    s_stats.spilled += n;
+  }
+  m_popping.store(false, std::memory_order_release);
+}
+
+bool MessageQueue::write_spill(Frame **frames, size_t n) {
+  if (m_spillfd < 0) {
+    std::string path = m_limits.spill_dir + "/spill.XXXXXX";
+    m_spillfd = mkostemp(&path[0], O_CLOEXEC);
+    if (m_spillfd < 0) {
+      return false;
+    }
+    unlink(path.c_str()); // goes away with the queue, or a crash
+  }
+
+  uint32_t lens[SPILL_BATCH];
+  struct iovec iov[2 * SPILL_BATCH];
+  for (size_t i = 0; i < n; i++) {
+    lens[i] = frames[i]->size();
+    iov[2 * i].iov_base = &lens[i];
+    iov[2 * i].iov_len = sizeof(lens[i]);
+    iov[2 * i + 1].iov_base = const_cast<char *>(frames[i]->data());
+    iov[2 * i + 1].iov_len = frames[i]->size();
+  }
+
+  struct iovec *v = iov;
+  int count = 2 * n;
+  off_t at = m_spill_end;
+  while (count > 0) {
+    ssize_t w = pwritev(m_spillfd, v, count, at);
+    if (w < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false; // a partial record past m_spill_end is never read
+    }
+    at += w;
+    while (count > 0 && size_t(w) >= v->iov_len) {
+      w -= v->iov_len;
+      v++;
+      count--;
+    }
+    if (count > 0) {
+      v->iov_base = static_cast<char *>(v->iov_base) + w;
+      v->iov_len -= w;
+    }
+  }
+  m_spill_end = at;
+  return true;
+}
+
+Frame *MessageQueue::read_spill() {
+  while (true) {
+    size_t have = m_spill_buf.size() - m_spill_off;
+    size_t need = sizeof(uint32_t);
+    if (have >= need) {
+      uint32_t len;
+      memcpy(&len, &m_spill_buf[m_spill_off], sizeof(len));
+      need += len;
+      if (have >= need) {
+        Frame *frame = Frame::make_copy(&m_spill_buf[m_spill_off + sizeof(len)], len);
+        m_spill_off += need;
+        s_stats.unspilled++;
+        if (m_spilled.fetch_sub(1, std::memory_order_relaxed) == 1) {
+          // all caught up: start the file over
+          m_spill_buf.clear();
+          m_spill_off = 0;
+          m_spill_pos = m_spill_end = 0;
+          int rc = ftruncate(m_spillfd, 0);
+          (void) rc; // a failure only costs disk space
+        }
+        return frame;
+      }
+    }
+
+    // keep the partial record and read at least the rest of it
+    m_spill_buf.erase(m_spill_buf.begin(), m_spill_buf.begin() + m_spill_off);
+    m_spill_off = 0;
+    size_t want = std::min<off_t>(std::max(SPILL_CHUNK, need - have), m_spill_end - m_spill_pos);
+    m_spill_buf.resize(have + want);
+    ssize_t n = (want > 0) ? pread(m_spillfd, &m_spill_buf[have], want, m_spill_pos) : 0;
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        m_spill_buf.resize(have);
+        continue;
+      }
+      // the spilled deliveries are lost, so is the receiver
+      s_stats.dropped_cut += m_spilled.exchange(0);
+      m_spill_buf.clear();
+      cut_off();
+      return nullptr;
+    }
+    m_spill_buf.resize(have + n);
+    m_spill_pos += n;
+  }
+}
+
+void MessageQueue::enqueue(Frame *frame) {
+  bool limited = m_limits.max_frames || m_limits.max_bytes;
+  // under these producers make room by popping, not by refusing frames
+  bool pops = (m_limits.policy == QueueLimits::DROP_OLDEST
+               || m_limits.policy == QueueLimits::SPILL);
+  if (limited) {
+    if (m_overflowed.load()) {
+      frame->release(); // already cut off
+      s_stats.dropped_cut++;
+      return;
+    }
+    if (!pops && over_limits(frame->size())) {
+      overflow(frame);
+      return;
+    }
+  }
+
+  // counted before the push, so the consumer never takes them below 0
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  m_bytes.fetch_add(frame->size(), std::memory_order_relaxed);
+
+  Node *node = new (s_node_pool.alloc()) Node;
+  node->frame = frame;
+  push(node);
+
+  if (limited && pops && over_limits(0)) {
+    if (m_limits.policy == QueueLimits::SPILL) {
+      spill();
+    } else {
+      trim();
+    }
+  }
+
+  wake();
+}
+
+void MessageQueue::wake() {
+  // only pay for the wakeup syscall if the receiver is really asleep
+  if (m_sleeping.load() == 1 && m_sleeping.exchange(0) == 1) {
+    uint64_t one = 1;
+    ssize_t rc = write(m_wakefd, &one, sizeof(one));
+    (void) rc; // only fails if the counter is already nonzero
+  }
+
+  if (m_notify) {
+    m_notify(m_notify_arg);
+  }
+}
+
+Frame *MessageQueue::dequeue(int watch_fd) {
+  Frame *frame;
+
+  while (true) {
+    PopResult r = take(frame);
+    if (r == POPPED) {
+      return frame;
+    }
+    if (r == BUSY) {
+      sched_yield(); // a push is half done, it will finish momentarily
+      continue;
+    }
+
+    if (m_wakefd < 0) {
+      m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    // announce that we are going to sleep and look once more: a
+    // producer either sees the flag or its frame is seen here
+    m_sleeping.store(1);
+    r = take(frame);
+    if (r == EMPTY) {
+      struct pollfd fds[2];
+      fds[0].fd = m_wakefd;
+      fds[0].events = POLLIN;
+      fds[1].fd = watch_fd; // ignored by poll when negative
+      fds[1].events = POLLRDHUP;
+      fds[0].revents = fds[1].revents = 0;
+
+      if (poll(fds, 2, -1) > 0) {
+        if (fds[0].revents & POLLIN) {
+          uint64_t count;
+          ssize_t rc = read(m_wakefd, &count, sizeof(count));
+          (void) rc;
+        }
+        if (fds[1].revents) {
+          m_sleeping.store(0);
+          return nullptr; // peer hung up (or the socket failed)
+        }
+      }
+    }
+    m_sleeping.store(0);
+
+    if (r == POPPED) {
+      return frame;
+    }
+  }
+}
+
+void MessageQueue::poke() {
+  m_poked.store(true);
+  wake();
+}
+
+bool MessageQueue::ready() {
+  // only the consumer moves m_tail, and an empty queue is just the stub
+  return m_poked.exchange(false) || m_tail != &m_stub || m_head.load() != &m_stub
+    || m_spilled.load() > 0;
+}
+
+bool MessageQueue::wait(int watch_fd) {
+  while (!ready()) {
+    if (m_wakefd < 0) {
+      m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    // the same handshake as dequeue: a poke or push either sees the
+    // flag or is seen by the second look
+    m_sleeping.store(1);
+    if (!ready()) {
+      struct pollfd fds[2];
+      fds[0].fd = m_wakefd;
+      fds[0].events = POLLIN;
+      fds[1].fd = watch_fd;
+      fds[1].events = POLLRDHUP;
+      fds[0].revents = fds[1].revents = 0;
+
+      if (poll(fds, 2, -1) > 0) {
+        if (fds[0].revents & POLLIN) {
+          uint64_t count;
+          ssize_t rc = read(m_wakefd, &count, sizeof(count));
+          (void) rc;
+        }
+        if (fds[1].revents) {
+          m_sleeping.store(0);
+          return false;
+        }
+      }
+      m_sleeping.store(0);
+      continue;
+    }
+    m_sleeping.store(0);
+    return true;
+  }
+  return true;
+}
+
+Frame *MessageQueue::try_dequeue() {
+  Frame *frame;
+  PopResult r;
+  while ((r = take(frame)) == BUSY) {
+    sched_yield();
+  }
+  return (r == POPPED) ? frame : nullptr;
+}
+
+void MessageQueue::set_notify(NotifyFn fn, void *arg) {
+  m_notify = fn;
+  m_notify_arg = arg;
+}
+
+void MessageQueue::set_limits(const QueueLimits &limits) {
+  m_limits = limits;
+}
+
+void MessageQueue::set_receiver(int sockfd, bool binary) {
+  m_sockfd = sockfd;
+  m_binary = binary;
+}
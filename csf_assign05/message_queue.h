@@ -1,33 +1,177 @@
 #ifndef MESSAGE_QUEUE_H
 #define MESSAGE_QUEUE_H
 
-#include <deque>
-#include <pthread.h>
-#include <semaphore.h>
-struct Message;
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+class Frame;
+class BlockPool;
 
-// This data type represents a queue of Messages waiting to
-// be delivered to a receiver
+// How much a receiver may have queued, and what happens to a delivery
+// that would go over (0 means no limit)
+struct QueueLimits {
+  enum Policy {
+    DROP_NEWEST, // the new delivery is discarded
+    DROP_OLDEST, // the oldest queued deliveries make room for it
+    DISCONNECT,  // the receiver is cut off (its socket shut down)
+    MARK_GAP,    // like DROP_NEWEST, and the receiver is later sent
+                 // "missed:N" where the deliveries would have been
+    SPILL,       // the oldest queued deliveries are written to a file
+                 // (in spill_dir) and read back before the rest
+  };
+
+  size_t max_frames;
+  size_t max_bytes;
+  Policy policy;
+  std::string spill_dir;
+
+  QueueLimits() : max_frames(0), max_bytes(0), policy(DROP_NEWEST), spill_dir("/tmp") { }
+};
+
+// what the overflow policies have done, summed over all queues
+struct QueueStats {
+  std::atomic<unsigned long> dropped_newest; // DROP_NEWEST and MARK_GAP
+  std::atomic<unsigned long> dropped_oldest;
+  std::atomic<unsigned long> disconnects;    // receivers cut off
+  std::atomic<unsigned long> dropped_cut;    // deliveries to cut off receivers
+  std::atomic<unsigned long> gap_markers;    // "missed" markers sent
+  std::atomic<unsigned long> spilled;        // deliveries written to spill files
+  std::atomic<unsigned long> unspilled;      // ... and read back
+};
+
+// This data type represents a queue of encoded deliveries (Frames)
+// waiting to be written to a receiver. The queue owns one reference
+// to each Frame it holds, dequeue hands that reference to the caller.
+//
+// Any number of threads may enqueue concurrently but only one thread
+// (the receiver's) may dequeue. Enqueue is lock-free (Vyukov's MPSC
+// linked queue) and dequeue only sleeps (in poll, on an eventfd) when
+// the queue is actually empty.
+//
+// The queue can be bounded (set_limits). Counts are kept with atomics
+// and checked before the push, so concurrent producers can overshoot a
+// limit by at most one delivery each.
+//
+// Under SPILL a queue over its limits doesn't lose anything: the
+// producer that notices moves the oldest deliveries to a file until the
+// list is down to half the limits, and the consumer reads them back
+// (before the list) as it catches up. Memory stays bounded, disk is not.
 class MessageQueue {
 public:
   MessageQueue();
   ~MessageQueue();
 
-  void enqueue(Message *msg); // will not block
-  Message *dequeue();         // blocks for at most a finite amount of time
+  // called (with arg) after every enqueue, used by the event-loop
+  // mode to wake the loop that owns the receiving connection
+  typedef void (*NotifyFn)(void *arg);
+
+  void enqueue(Frame *frame); // will not block, may drop (see QueueLimits)
+  Frame *try_dequeue();       // never blocks, nullptr if queue is empty
+
+  // blocks until a frame is available, or returns nullptr as soon as
+  // watch_fd (if >= 0) reports hangup or error, so a receiver thread
+  // sleeps for free and notices its socket dying right away
+  Frame *dequeue(int watch_fd = -1);
+
+  // for a consumer that also reads deliveries from elsewhere (a room
+  // log): poke wakes the consumer (and calls the notify hook) without
+  // queueing anything, wait sleeps like dequeue until the queue is not
+  // empty or it has been poked, false if watch_fd hung up
+  void poke();
+  bool wait(int watch_fd = -1);
+
+  // these must be set before the queue's User joins a room
+  void set_notify(NotifyFn fn, void *arg);
+  void set_limits(const QueueLimits &limits);
+
+  // what the overflow policies need to know about the receiver: the
+  // socket DISCONNECT shuts down, and whether gap markers are binary
+  // frames (binproto.h) or text lines
+  void set_receiver(int sockfd, bool binary);
+
+  // true once DISCONNECT has cut the receiver off
+  bool overflowed() const { return m_overflowed.load(); }
+
+  static const QueueStats &stats() { return s_stats; }
 
 private:
   // value semantics prohibited
   MessageQueue(const MessageQueue &);
   MessageQueue &operator=(const MessageQueue &);
 
-  // these data members are sufficient to implement the
-  // enqueue and dequeue operations: the idea is that the semaphore
-  // keeps a count of how many messages are currently in the queue
+  // a Frame sits on many queues at once, so the links can't live in
+  // the Frame itself and each enqueue gets its own node (from a pool)
+  struct Node {
+    std::atomic<Node *> next;
+    Frame *frame; // nullptr marks a gap (MARK_GAP)
+  };
+  static BlockPool s_node_pool;
+  static QueueStats s_stats;
+
+  enum PopResult { POPPED, EMPTY, BUSY };
+
+  void push(Node *node);
+  PopResult pop(Frame *&frame);
+
+  // pop with the consumer lock held if DROP_OLDEST or SPILL means
+  // producers may pop too; a gap node comes back as a "missed" frame
+  // (or is skipped if it has nothing to report), and anything spilled
+  // comes back before what is still queued
+  PopResult take(Frame *&frame);
+
+  bool over_limits(size_t frame_size, int shift = 0) const;
+  void overflow(Frame *frame);
+  void cut_off(); // DISCONNECT, or a spill file that can't be used
+  void trim();  // DROP_OLDEST
+  void spill(); // SPILL
+
+  // with the consumer lock held: write frames to the end of the spill
+  // file, and read the next spilled one back (nullptr on error)
+  bool write_spill(Frame **frames, size_t n);
+  Frame *read_spill();
+  void wake(); // the consumer, if it's asleep, and the notify hook
+  bool ready(); // for wait: a frame or a poke is waiting (consumes the poke)
+
+  // producers swing m_head, the consumer owns m_tail; m_stub keeps
+  // the list non-empty so neither side has to special case it
+  std::atomic<Node *> m_head;
+  Node *m_tail;
+  Node m_stub;
+
+  // 1 while the consumer is (about to be) asleep on m_wakefd, which
+  // is only created the first time the consumer actually has to wait
+  std::atomic<int> m_sleeping;
+  int m_wakefd;
+  std::atomic<bool> m_poked;
+
+  NotifyFn m_notify;
+  void *m_notify_arg;
+
+  // what is queued, kept by enqueue/pop for the limits
+  std::atomic<size_t> m_count;
+  std::atomic<size_t> m_bytes;
+  QueueLimits m_limits;
+  int m_sockfd;
+  bool m_binary;
+
+  std::atomic<bool> m_popping;     // the consumer lock, DROP_OLDEST and SPILL only
+  std::atomic<bool> m_overflowed;  // DISCONNECT has fired
+  std::atomic<bool> m_gap_queued;  // a gap node is waiting to be popped
+  std::atomic<uint32_t> m_missed;  // deliveries dropped since the last marker
 
-  pthread_mutex_t m_lock; // must be held while accessing queue
-  sem_t m_avail;
-  std::deque<Message *> m_messages;
+  // SPILL: an unlinked file made on the first spill, holding
+  // [4-byte length][frame] records that are all older than anything
+  // in the list; read back through m_spill_buf. Only touched with the
+  // consumer lock held, apart from m_spilled (for ready)
+  int m_spillfd;
+  off_t m_spill_end;             // where the next record is written
+  off_t m_spill_pos;             // where the next read starts
+  std::vector<char> m_spill_buf; // read but not yet taken, from m_spill_off
+  size_t m_spill_off;
+  std::atomic<size_t> m_spilled; // records not yet taken
 };
 
 #endif // MESSAGE_QUEUE_H
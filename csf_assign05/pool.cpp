@@ -0,0 +1,108 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "guard.h"
+#include "pool.h"
+
+namespace {
+
+// blocks moved between a thread cache and the shared list at a time
+const unsigned BATCH = 64;
+
+// a thread cache holding more than this gives a batch back
+const unsigned CACHE_MAX = 2 * BATCH;
+
+const unsigned MAX_POOLS = 8;
+std::atomic<unsigned> next_pool_id(0);
+
+// one of these per pool in every thread, a thread that exits gives
+// whatever it still holds back to the pool
+struct PoolCache {
+  BlockPool *pool;
+  BlockPool::FreeBlock *head;
+  unsigned count;
+
+  ~PoolCache() {
+    if (pool && head) {
+      pool->put_batch(head, count);
+    }
+  }
+};
+
+thread_local PoolCache t_caches[MAX_POOLS];
+
+}
+
+BlockPool::BlockPool(size_t block_size)
+  : m_block_size((block_size + 15) & ~(size_t) 15) // keep blocks 16-byte aligned
+  , m_id(next_pool_id.fetch_add(1)) {
+  if (m_id >= MAX_POOLS) {
+    throw std::bad_alloc(); // only a handful of static pools are expected
+  }
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+void *BlockPool::alloc() {
+  PoolCache &cache = t_caches[m_id];
+  if (!cache.head) {
+    cache.pool = this;
+    cache.head = get_batch(cache.count);
+  }
+
+  FreeBlock *block = cache.head;
+  cache.head = block->next;
+  cache.count--;
+  return block;
+}
+
+void BlockPool::free(void *p) {
+  PoolCache &cache = t_caches[m_id];
+  cache.pool = this;
+
+  FreeBlock *block = static_cast<FreeBlock *>(p);
+  block->next = cache.head;
+  cache.head = block;
+  cache.count++;
+
+  if (cache.count >= CACHE_MAX) {
+    // keep one batch, give the other back
+    FreeBlock *tail = cache.head;
+    for (unsigned i = 1; i < BATCH; i++) {
+      tail = tail->next;
+    }
+    FreeBlock *rest = tail->next;
+    tail->next = nullptr;
+    put_batch(cache.head, BATCH);
+    cache.head = rest;
+    cache.count -= BATCH;
+  }
+}
+
+void BlockPool::put_batch(FreeBlock *head, unsigned count) {
+  Guard g(m_lock);
+  m_batches.push_back(Batch{ head, count });
+}
+
+BlockPool::FreeBlock *BlockPool::get_batch(unsigned &count) {
+  {
+    Guard g(m_lock);
+    if (!m_batches.empty()) {
+      Batch b = m_batches.back();
+      m_batches.pop_back();
+      count = b.count;
+      return b.head;
+    }
+  }
+
+  // nothing to reuse: carve a fresh slab into one batch of blocks
+  char *slab = static_cast<char *>(malloc(m_block_size * BATCH));
+  if (!slab) {
+    throw std::bad_alloc();
+  }
+  for (unsigned i = 0; i < BATCH; i++) {
+    FreeBlock *block = reinterpret_cast<FreeBlock *>(slab + i * m_block_size);
+    block->next = (i + 1 < BATCH) ? reinterpret_cast<FreeBlock *>(slab + (i + 1) * m_block_size) : nullptr;
+  }
+  count = BATCH;
+  return reinterpret_cast<FreeBlock *>(slab);
+}
@@ -0,0 +1,52 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <vector>
+#include <pthread.h>
+
+// A BlockPool hands out fixed-size blocks carved from large slabs.
+// Every thread keeps a small cache of free blocks per pool and trades
+// whole batches with the pool's shared free list, so alloc and free
+// are normally a thread-local pointer pop/push with no lock and no
+// malloc. A block may be freed by a different thread than the one
+// that allocated it (the usual case for a broadcast Frame).
+//
+// Pools are meant to be static objects that live for the whole
+// process; their memory is never given back to the system.
+class BlockPool {
+public:
+  BlockPool(size_t block_size);
+
+  void *alloc();
+  void free(void *block);
+
+  size_t block_size() const { return m_block_size; }
+
+  // link for free blocks, stored in the block itself
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  // hand a list of count blocks back to the shared free list
+  void put_batch(FreeBlock *head, unsigned count);
+
+private:
+  // value semantics prohibited
+  BlockPool(const BlockPool &);
+  BlockPool &operator=(const BlockPool &);
+
+  FreeBlock *get_batch(unsigned &count);
+
+  size_t m_block_size;
+  unsigned m_id; // index of this pool's cache in each thread
+
+  pthread_mutex_t m_lock; // protects m_batches
+  struct Batch {
+    FreeBlock *head;
+    unsigned count;
+  };
+  std::vector<Batch> m_batches;
+};
+
+#endif // POOL_H
@@ -1,81 +1,174 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <stdexcept>
+#include <cstdint>
+#include <unistd.h>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
+#include "binproto.h"
 #include "client_util.h"
 
-int main(int argc, char **argv) {
-  if (argc != 5) {
-    std::cerr << "Usage: ./receiver [server_address] [port] [username] [room]\n";
-    return 1;
-  }
-
-  std::string server_hostname = argv[1];
-  int server_port = std::stoi(argv[2]);
-  std::string username = argv[3];
-  std::string room_name = argv[4];
-
-  Connection conn;
-
-  // TODO: connect to server
+static void usage() {
+  std::cerr << "Usage: ./receiver [-b | -i] [-R] [server_address] [port] [username] [room]\n"
+               "  (-R: ask for numbered deliveries, and if the connection drops,\n"
+               "   reconnect and resume after the last one; needs a server with -R)\n";
+}
 
+// connect, log in and join (or resume after last_seq, if have_seq),
+// false after saying why if any of it fails
+static bool start_session(Connection &conn, const std::string &host, int port,
+                          const std::string &login_tag, const std::string &username,
+                          const std::string &join_tag, const std::string &room_name,
+                          bool binary, bool have_seq, uint64_t last_seq) {
   try {  // try chat server connect
-    conn.connect(server_hostname, server_port);
+    conn.connect(host, port);
   } catch (const std::exception &e) { // exception bc connection fails
     std::cerr << "There is unfortunately an error when we try connecting to server which is " << e.what() << std::endl;
-    return 1;
+    return false;
   }
 
-
-
-  // TODO: send rlogin and join messages (expect a response from
-  //       the server for each one)
-  Message msg(TAG_RLOGIN, username); // help for sending rlogin username to server
+  Message msg(login_tag, username); // help for sending rlogin username to server
 
   // send it and wait for server to respond
   if (!conn.send(msg) || !conn.receive(msg) || msg.tag == TAG_ERR) { // if server gives error msg print stderr and leave
     std::cerr << msg.data << std::endl;
-    return 1;
+    return false;
   }
+  conn.set_binary(binary); // the login reply was the last text line
 
-  msg = Message(TAG_JOIN, room_name); // message for join room name to server
+  msg = have_seq ? Message(TAG_RESUME, std::to_string(last_seq) + ":" + room_name)
+                 : Message(join_tag, room_name); // message for join room name to server
 
   // again wait for server to confirm this
   if (!conn.send(msg) || !conn.receive(msg) || msg.tag == TAG_ERR) {
     std::cerr << msg.data << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bool binary = false; // ask for binary frames (binproto.h) at login
+  bool ids = false;    // ...with deliveries naming room and sender by ID
+  bool resume = false; // numbered deliveries, reconnect and resume after a drop
+
+  int opt;
+  while ((opt = getopt(argc, argv, "biR")) != -1) {
+    switch (opt) {
+    case 'R':
+      resume = true;
+      break;
+    case 'b':
+      binary = true;
+      break;
+    case 'i':
+      binary = ids = true;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc - optind != 4) {
+    usage();
     return 1;
   }
 
+  std::string server_hostname = argv[optind];
+  int server_port = std::stoi(argv[optind + 1]);
+  std::string username = argv[optind + 2];
+  std::string room_name = argv[optind + 3];
+
+  std::string login_tag = ids ? TAG_RLOGIN_IDS : binary ? TAG_RLOGIN_BIN : TAG_RLOGIN;
+  std::string join_tag = resume ? TAG_JOIN_SEQ : TAG_JOIN;
+  bool have_seq = false; // had a numbered delivery (-R), last_seq is the last one
+  uint64_t last_seq = 0;
 
   // TODO: loop waiting for messages from server
   //       (which should be tagged with TAG_DELIVERY)
   // receiver shouldnt send again but only listen for messages now
-  while (true) { // look to receive next server message
-    if (!conn.receive(msg)) { // if connection clsosed or error break
-      break;
+  std::unordered_map<uint32_t, std::string> names; // announced by the server
+  bool connected = false; // at least once
+  int retries = 0;
+
+  while (true) {
+    Connection conn;
+    if (!start_session(conn, server_hostname, server_port, login_tag, username,
+                       join_tag, room_name, binary, have_seq, last_seq)) {
+      // with -R a server that is coming back gets a few seconds
+      if (!resume || !connected || ++retries > 10) {
+        return 1;
+      }
+      sleep(1);
+      continue;
     }
+    connected = true;
+    retries = 0;
 
-    // if our message is broadcast delivery you should print
-    if (msg.tag == TAG_DELIVERY) {
-      // specific format for server send defined
-      size_t first = msg.data.find(':');
-      size_t second = msg.data.find(':', first + 1);
-      
-      if (first != std::string::npos && second != std::string::npos) {
-        // extract sender's name and message text
-        std::string sender = msg.data.substr(first + 1, second - first - 1);
-        std::string text = msg.data.substr(second + 1);
-
-        // you need to display ts in form of sender: message
-        std::cout << sender << ": " << text << std::endl;
+    Message msg;
+    while (true) { // look to receive next server message
+      if (!conn.receive(msg)) { // if connection clsosed or error break
+        break;
       }
-    // if server send error msg then print to stderr
-    } else if (msg.tag == TAG_ERR) {
-      std::cerr << msg.data << std::endl;
+
+      // numbered deliveries lead with the number, then look like the others
+      if (msg.tag == TAG_DELIVERY_SEQ || msg.tag == TAG_DELIVERY_ID_SEQ) {
+        size_t seq_len = 8;
+        if (binary && msg.data.size() >= seq_len) {
+          last_seq = bin_get_u64(msg.data.data());
+        } else if (!binary) {
+          last_seq = std::stoull(msg.data);
+          seq_len = msg.data.find(':') + 1;
+        }
+        have_seq = true;
+        msg.tag = (msg.tag == TAG_DELIVERY_SEQ) ? TAG_DELIVERY : TAG_DELIVERY_ID;
+        msg.data.erase(0, seq_len);
+      }
+
+      // if our message is broadcast delivery you should print
+      if (msg.tag == TAG_NAME && msg.data.size() >= 4) {
+        names[bin_get_u32(msg.data.data())] = msg.data.substr(4);
+      } else if (msg.tag == TAG_DELIVERY_ID && msg.data.size() >= 8) {
+        // room and sender IDs, then the text
+        uint32_t sender = bin_get_u32(msg.data.data() + 4);
+        std::cout << names[sender] << ": " << msg.data.substr(8) << std::endl;
+      } else if (msg.tag == TAG_MISSED) {
+        // our queue on the server overflowed
+        uint32_t n = binary && msg.data.size() >= 4 ? bin_get_u32(msg.data.data()) : std::stoul(msg.data);
+        std::cerr << "(missed " << n << " messages)" << std::endl;
+      } else if (msg.tag == TAG_DELIVERY && binary) {
+        // room and sender are length prefixed, the text is the rest
+        std::string room, sender, text;
+        if (bin_split_delivery(msg.data, room, sender, text)) {
+          std::cout << sender << ": " << text << std::endl;
+        }
+      } else if (msg.tag == TAG_DELIVERY) {
+        // specific format for server send defined
+        size_t first = msg.data.find(':');
+        size_t second = msg.data.find(':', first + 1);
+
+        if (first != std::string::npos && second != std::string::npos) {
+          // extract sender's name and message text
+          std::string sender = msg.data.substr(first + 1, second - first - 1);
+          std::string text = msg.data.substr(second + 1);
+
+          // you need to display ts in form of sender: message
+          std::cout << sender << ": " << text << std::endl;
+        }
+      // if server send error msg then print to stderr
+      } else if (msg.tag == TAG_ERR) {
+        std::cerr << msg.data << std::endl;
+      }
+    }
+
+    if (!resume) {
+      break;
     }
+    std::cerr << "(connection lost, resuming)" << std::endl;
   }
 
 
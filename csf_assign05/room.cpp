@@ -1,43 +1,554 @@
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <sched.h>
 #include "guard.h"
 #include "message.h"
+#include "binproto.h"
+#include "frame.h"
 #include "message_queue.h"
 #include "user.h"
+#include "intern.h"
+#include "history.h"
 #include "room.h"
 
-Room::Room(const std::string &room_name)
-  : room_name(room_name) {
+FlowStats Room::s_flow_stats;
+
+namespace {
+
+// the longest frame a member of each format can be sent
+const size_t MAX_FRAME_LEN[User::NUM_FORMATS] = {
+  Message::MAX_LEN,
+  BIN_HEADER_LEN + BIN_MAX_PAYLOAD,
+  BIN_HEADER_LEN + BIN_MAX_PAYLOAD,
+};
+
+}
+
+Room::Room(const std::string &room_name, const FlowLimits &flow, size_t log_capacity,
+           RoomHistory *history, size_t retain)
+  : room_name(room_name)
+  , id(InternTable::global().intern(room_name))
+  , flow(flow)
+  , throttling(false)
+  , log(log_capacity)
+  , log_head(0)
+  , history(history)
+  , retained(retain)
+  , seq_head(history ? history->next_seq() : 0)
+  , seq_tail(seq_head)
+  , snapshot(new Snapshot())
+  , epoch(0) {
   pthread_mutex_init(&lock, nullptr); // init mutex
+  pthread_mutex_init(&log_lock, nullptr);
+  pthread_mutex_init(&seq_lock, nullptr);
+  pthread_mutex_init(&flow_lock, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&flow_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  queued.low = long(flow.low_water);
+  queued.drained = on_drained;
+  queued.arg = this;
+  for (LogEntry &entry : log) {
+    std::fill(entry.frames, entry.frames + User::NUM_FORMATS, nullptr);
+  }
+  for (Retained &entry : retained) {
+    std::fill(entry.frames, entry.frames + User::NUM_FORMATS, nullptr);
+  }
+  readers[0].store(0);
+  readers[1].store(0);
 }
 
 Room::~Room() {
+  for (LogEntry &entry : log) {
+    for (Frame *f : entry.frames) {
+      if (f) {
+        f->release();
+      }
+    }
+  }
+  for (Retained &entry : retained) {
+    for (Frame *f : entry.frames) {
+      if (f) {
+        f->release();
+      }
+    }
+  }
+  delete snapshot.load();
+  delete history;
+  pthread_cond_destroy(&flow_cond);
+  pthread_mutex_destroy(&flow_lock);
+  pthread_mutex_destroy(&seq_lock);
+  pthread_mutex_destroy(&log_lock);
   pthread_mutex_destroy(&lock); // destroy mutex
 }
 
-void Room::add_member(User *user) {
-  //Guard g(lock);
-  pthread_mutex_lock(&lock);
-  members.insert(user); // add user to room
-  pthread_mutex_unlock(&lock);
+const Room::Snapshot *Room::read_begin(unsigned &e) {
+  while (true) {
+    e = epoch.load();
+    readers[e & 1].fetch_add(1);
+    if (epoch.load() == e) {
+      break; // the writer will wait for us before freeing anything
+    }
+    readers[e & 1].fetch_sub(1); // raced with a flip, try again
+  }
+  return snapshot.load();
+}
+
+void Room::read_end(unsigned e) {
+  readers[e & 1].fetch_sub(1);
+}
+
+void Room::publish() {
+  Snapshot *snap = new Snapshot();
+  snap->members.reserve(members.size());
+  for (int k = 0; k < NUM_KINDS; k++) {
+    snap->start[k] = snap->members.size();
+    for (User *u : members) {
+      if (kind(u) == k) {
+        snap->members.push_back(u);
+      }
+    }
+  }
+  snap->start[NUM_KINDS] = snap->members.size();
+  const Snapshot *old = snapshot.exchange(snap);
+
+  // new readers pick up the new snapshot, wait out the ones that
+  // may still be looking at the old one
+  unsigned e = epoch.fetch_add(1);
+  while (readers[e & 1].load() != 0) {
+    sched_yield();
+  }
+
+  delete old;
+}
+
+void Room::add_member(User *user, uint64_t *history_end) {
+  Guard g(lock);
+  if (!history) {
+    join(user);
+    return;
+  }
+
+  // no broadcast can land between the last one in the history we
+  // report and the first one the user gets live (publish's grace
+  // period is over at once: broadcasts read snapshots under this lock)
+  Guard h(history->lock());
+  join(user);
+  if (history_end) {
+    *history_end = history->next_seq();
+  }
+}
+
+void Room::resume_member(User *user, uint64_t next, RetainedCursor &cur) {
+  Guard g(lock);
+
+  // nothing gets numbered between cur.end and the first delivery the
+  // user gets live (no broadcast is reading a snapshot while we hold
+  // this, so publish doesn't wait either)
+  Guard o(order_lock());
+  cur.end = seq_head;
+  cur.next = std::min(next, cur.end);
+  cur.names = cur.named = 0;
+
+  // the names would be queued behind the catch-up that uses them, so
+  // it sends them itself
+  bool catching_up = cur.next < cur.end && user->format == User::BINARY_IDS;
+  if (catching_up) {
+    cur.names = 1 + senders.size();
+  }
+  join(user, !catching_up);
+}
+
+size_t Room::read_retained(User::Format format, RetainedCursor &cur, Frame **frames,
+                           size_t max) {
+  size_t n = 0;
+  if (cur.named < cur.names) {
+    Guard g(lock); // senders
+    for (; n < max && cur.named < cur.names; cur.named++) {
+      uint32_t name_id = (cur.named == 0) ? id : senders[cur.named - 1];
+      frames[n++] = Frame::make_name(name_id, InternTable::global().name(name_id));
+    }
+  }
+
+  Guard o(order_lock());
+  uint64_t oldest = std::min(seq_tail, cur.end);
+  if (n < max && cur.next < oldest) {
+    // overwritten before the user got to them
+    uint64_t missed = std::min<uint64_t>(oldest - cur.next, UINT32_MAX);
+    frames[n++] = Frame::make_missed(uint32_t(missed), format != User::TEXT);
+    cur.next = oldest;
+  }
+
+  while (n < max && cur.next < cur.end) {
+    Frame *f = retained_frame(cur.next++, format);
+    if (f) { // nullptr: can't be sent in this format
+      frames[n++] = f;
+    }
+  }
+  return n;
+}
+
+pthread_mutex_t &Room::order_lock() {
+  return history ? history->lock() : seq_lock;
+}
+
+void Room::join(User *user, bool names) {
+  if (member_index.count(user)) {
+    return; // already a member
+  }
+  if (names && user->format == User::BINARY_IDS) {
+    // the names go ahead of anything the user can be sent by ID
+    send_name(user, id, room_name);
+    for (uint32_t sender : senders) {
+      send_name(user, sender, InternTable::global().name(sender));
+    }
+  }
+  if (has_log()) {
+    Guard lg(log_lock);
+    // history isn't replayed, so the user starts out caught up and
+    // waiting for the next append
+    user->log_next = log_head;
+    add_log_waiter(user);
+  }
+  member_index[user] = members.size();
+  members.push_back(user); // add user to room
+  publish();
+}
+
+void Room::add_sender(const User *sender) {
+  Guard g(lock);
+  if (!sender_set.insert(sender->id).second) {
+    return; // already announced
+  }
+  senders.push_back(sender->id);
+  if (has_log()) {
+    // an entry only members by ID read, so it lands in order with the
+    // deliveries (members that join later get it from senders)
+    Frame *frames[User::NUM_FORMATS] = { nullptr, nullptr, nullptr };
+    frames[User::BINARY_IDS] = Frame::make_name(sender->id, sender->username);
+    append_log(frames);
+    return;
+  }
+  for (User *u : members) {
+    if (u->format == User::BINARY_IDS) {
+      send_name(u, sender->id, sender->username);
+    }
+  }
+}
+
+void Room::send_name(User *user, uint32_t name_id, const std::string &name) {
+  user->mqueue.enqueue(Frame::make_name(name_id, name));
 }
 
 void Room::remove_member(User *user) {
-  // TODO: remove User from the room
-  /*Guard g(m_lock);
-  members.erase(user);*/
-  pthread_mutex_lock(&lock);
-  members.erase(user);
-  pthread_mutex_unlock(&lock);
+  Guard g(lock);
+  auto it = member_index.find(user);
+  if (it == member_index.end()) {
+    return;
+  }
+
+  // move the last member into the hole
+  size_t pos = it->second;
+  User *last = members.back();
+  members[pos] = last;
+  member_index[last] = pos;
+  members.pop_back();
+  member_index.erase(user);
+
+  if (has_log()) {
+    Guard lg(log_lock);
+    if (user->log_waiting) {
+      // move the last waiter into the hole, like members
+      User *last = log_waiters.back();
+      log_waiters[user->log_waiter_pos] = last;
+      last->log_waiter_pos = user->log_waiter_pos;
+      log_waiters.pop_back();
+      user->log_waiting = false;
+    }
+  }
+
+  publish();
+}
+
+bool Room::broadcast_message(uint32_t sender_id, const char *text, size_t text_len,
+                             uint64_t *round) {
+  if (round) {
+    *round = 0;
+  }
+  if (!history && !keeps_sequence()) {
+    deliver(sender_id, text, text_len, Frame::NO_SEQ);
+    return true;
+  }
+
+  // kept even when nobody is listening, and in the same order that
+  // members get them; with a history its numbers are the ring's too
+  Guard h(order_lock());
+  const std::string &sender = InternTable::global().name(sender_id);
+  uint64_t seq = Frame::NO_SEQ;
+  if (history) {
+    uint64_t r;
+    seq = history->append(room_name, sender, text, text_len, r);
+    if (seq == Frame::NO_SEQ && history->durable()) {
+      return false; // the sender would be told it's on disk
+    }
+    if (round) {
+      *round = r;
+    }
+  } else if (bin_delivery_fits(room_name.size(), sender.size(), text_len)) {
+    seq = seq_head;
+  }
+  deliver(sender_id, text, text_len, seq);
+  return true;
+}
+
+void Room::deliver(uint32_t sender_id, const char *text, size_t text_len, uint64_t seq) {
+  unsigned e;
+  const Snapshot *snap = read_begin(e);
+
+  // encode the delivery once per format, every member of that format
+  // shares the same frame
+  const MemberList &list = snap->members;
+  const size_t *start = snap->start;
+  const std::string &sender = InternTable::global().name(sender_id);
+
+  Frame *frames[NUM_KINDS];
+  std::fill(frames, frames + NUM_KINDS, nullptr);
+  bool line_ok = text_len < Message::MAX_LEN && !memchr(text, '\n', text_len);
+  if (start[User::TEXT] < start[User::TEXT + 1] && line_ok) {
+    frames[User::TEXT] = Frame::make_delivery(room_name, sender, text, text_len);
+  }
+  if (start[User::BINARY] < start[User::BINARY + 1]) {
+    frames[User::BINARY] = Frame::make_delivery_bin(room_name, sender, text, text_len);
+  }
+  if (start[User::BINARY_IDS] < start[User::BINARY_IDS + 1]) {
+    frames[User::BINARY_IDS] = Frame::make_delivery_ids(id, sender_id, text, text_len);
+  }
+  if (keeps_sequence() && seq != Frame::NO_SEQ) {
+    retain(seq, sender_id, sender, text, text_len, line_ok, start, frames + User::NUM_FORMATS);
+  }
+
+  if (has_log()) {
+    // (log rooms don't keep sequence numbers, so nobody is stamped)
+    for (int f = 0; f < User::NUM_FORMATS; f++) {
+      if (frames[f] && frames[f]->size() > MAX_FRAME_LEN[f]) {
+        frames[f]->release();
+        frames[f] = nullptr;
+      }
+    }
+    append_log(frames);
+  } else {
+    for (int k = 0; k < NUM_KINDS; k++) {
+      if (frames[k]) {
+        fan_out(frames[k], &list[start[k]], start[k + 1] - start[k],
+                MAX_FRAME_LEN[k % User::NUM_FORMATS]);
+      }
+    }
+  }
+
+  read_end(e);
+}
+
+void Room::retain(uint64_t seq, uint32_t sender_id, const std::string &sender, const char *text,
+                  size_t text_len, bool line_ok, const size_t *start, Frame **frames) {
+  // the ring's copy, kept apart from what is fanned out so flow
+  // control's accounting never sees it
+  Frame *bin = Frame::make_delivery_bin(room_name, sender, text, text_len, seq);
+  seq_head = seq + 1;
+
+  const size_t *stamped = start + User::NUM_FORMATS;
+  if (stamped[User::TEXT] < stamped[User::TEXT + 1] && line_ok) {
+    frames[User::TEXT] = Frame::make_delivery(room_name, sender, text, text_len, seq);
+  }
+  if (stamped[User::BINARY] < stamped[User::BINARY + 1]) {
+    frames[User::BINARY] = Frame::make_delivery_bin(room_name, sender, text, text_len, seq);
+  }
+  if (stamped[User::BINARY_IDS] < stamped[User::BINARY_IDS + 1]) {
+    frames[User::BINARY_IDS] = Frame::make_delivery_ids(id, sender_id, text, text_len, seq);
+  }
+
+  Retained &entry = retained[seq % retained.size()];
+  for (Frame *&f : entry.frames) {
+    if (f) {
+      f->release(); // resumes still sending it hold their own references
+      f = nullptr;
+    }
+  }
+  entry.frames[User::BINARY] = bin;
+  entry.sender_id = sender_id;
+  if (seq_head - seq_tail > retained.size()) {
+    seq_tail = seq_head - retained.size();
+  }
+}
+
+Frame *Room::retained_frame(uint64_t seq, User::Format format) {
+  Retained &entry = retained[seq % retained.size()];
+  Frame *&f = entry.frames[format];
+  if (!f) {
+    // the binary frame is the number, then the room and sender (each
+    // after a one byte length), then the text
+    const Frame *bin = entry.frames[User::BINARY];
+    const char *p = bin->data() + BIN_HEADER_LEN + 8;
+    const char *end = bin->data() + bin->size();
+    p += 1 + uint8_t(*p);
+    std::string sender(p + 1, uint8_t(*p));
+    p += 1 + sender.size();
+    size_t text_len = end - p;
+
+    if (format == User::BINARY_IDS) {
+      f = Frame::make_delivery_ids(id, entry.sender_id, p, text_len, seq);
+    } else if (text_len < Message::MAX_LEN && !memchr(p, '\n', text_len)) {
+      f = Frame::make_delivery(room_name, sender, p, text_len, seq);
+    }
+  }
+
+  if (!f || f->size() > MAX_FRAME_LEN[format]) {
+    return nullptr;
+  }
+  f->add_refs(1);
+  return f;
+}
+
+void Room::fan_out(Frame *frame, User *const *users, size_t n, size_t max_len) {
+  if (frame->size() > max_len) {
+    frame->release(); // too long for the protocol, no receiver could take it
+    return;
+  }
+
+  frame->add_refs(n); // one per queue, taken up front
+  if (flow.high_water) {
+    frame->charge(&queued, n + 1); // our own reference goes back below
+  }
+  for (size_t i = 0; i < n; i++) {
+    users[i]->mqueue.enqueue(frame); // enqueue for each receiver
+  }
+
+  frame->release(); // drop our own reference
 }
 
-void Room::broadcast_message(const std::string &sender_username, const std::string &message_text) {
-  // TODO: send a message to every (receiver) User in the room
-  pthread_mutex_lock(&lock);
+bool Room::congested() {
+  if (!flow.high_water) {
+    return false;
+  }
+
+  // racing callers can only disagree about a crossing, not miss one
+  long q = queued.bytes.load(std::memory_order_relaxed);
+  if (!throttling.load(std::memory_order_relaxed)) {
+    if (q >= long(flow.high_water)) {
+      throttling.store(true, std::memory_order_relaxed);
+    }
+  } else if (q <= long(flow.low_water)) {
+    throttling.store(false, std::memory_order_relaxed);
+  }
+  return throttling.load(std::memory_order_relaxed);
+}
+
+bool Room::arm_drained() {
+  // a release between the check and the arming would see the hook
+  // unarmed, so look again once it is armed (the fence pairs with the
+  // fetch_sub/load in FrameAccount::give_back)
+  queued.armed.store(true);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return congested();
+}
+
+bool Room::wait_uncongested(long deadline_ms) {
+  struct timespec deadline;
+  deadline.tv_sec = deadline_ms / 1000;
+  deadline.tv_nsec = (deadline_ms % 1000) * 1000000;
+
+  Guard g(flow_lock);
+  while (arm_drained()) {
+    if (pthread_cond_timedwait(&flow_cond, &flow_lock, &deadline) == ETIMEDOUT) {
+      return !congested();
+    }
+  }
+  return true;
+}
+
+bool Room::notify_drained(NotifyFn fn, void *arg) {
+  Guard g(flow_lock);
+  if (!arm_drained()) {
+    return false;
+  }
+  // each loop only needs waking once, however many senders it holds
+  std::pair<NotifyFn, void *> waiter(fn, arg);
+  if (std::find(drain_waiters.begin(), drain_waiters.end(), waiter) == drain_waiters.end()) {
+    drain_waiters.push_back(waiter);
+  }
+  return true;
+}
 
-  //Guard g(lock);
-  for (User* user_in_members : members) {
-  Message *msg = new Message(TAG_DELIVERY, room_name + ":" + sender_username + ":" + message_text);
-    user_in_members->mqueue.enqueue(msg); // enqueue for each receiver
+void Room::on_drained(void *arg) {
+  Room *room = static_cast<Room *>(arg);
+  std::vector<std::pair<NotifyFn, void *>> waiters;
+  {
+    Guard g(room->flow_lock);
+    waiters.swap(room->drain_waiters);
+    pthread_cond_broadcast(&room->flow_cond);
   }
+  // outside the lock: a loop's wakeup takes the loop's own lock
+  for (auto &w : waiters) {
+    w.first(w.second);
+  }
+}
 
-  pthread_mutex_unlock(&lock);
-}
\ No newline at end of file
+void Room::append_log(Frame *const *frames) {
+  Frame *old[User::NUM_FORMATS];
+  {
+    Guard g(log_lock);
+    LogEntry &entry = log[log_head % log.size()];
+    std::copy(entry.frames, entry.frames + User::NUM_FORMATS, old);
+    std::copy(frames, frames + User::NUM_FORMATS, entry.frames);
+    log_head++;
+
+    // only readers that have caught up need waking, the rest will
+    // get to this entry anyway
+    for (User *u : log_waiters) {
+      u->log_waiting = false;
+      u->mqueue.poke();
+    }
+    log_waiters.clear();
+  }
+
+  // the entry that fell off the end (readers hold their own references)
+  for (Frame *f : old) {
+    if (f) {
+      f->release();
+    }
+  }
+}
+
+size_t Room::read_log(User *user, Frame **frames, size_t max) {
+  Guard g(log_lock);
+  size_t n = 0;
+
+  uint64_t oldest = (log_head > log.size()) ? log_head - log.size() : 0;
+  if (user->log_next < oldest) {
+    // overwritten before this user got to them
+    uint32_t missed = uint32_t(oldest - user->log_next);
+    frames[n++] = Frame::make_missed(missed, user->format != User::TEXT);
+    user->log_next = oldest;
+  }
+
+  while (n < max && user->log_next < log_head) {
+    Frame *f = log[user->log_next++ % log.size()].frames[user->format];
+    if (f) { // nullptr: nothing for this format (e.g. a name entry)
+      f->add_refs(1);
+      frames[n++] = f;
+    }
+  }
+
+  if (n == 0 && !user->log_waiting) {
+    add_log_waiter(user);
+  }
+  return n;
+}
+
+void Room::add_log_waiter(User *user) {
+  user->log_waiting = true;
+  user->log_waiter_pos = log_waiters.size();
+  log_waiters.push_back(user);
+}
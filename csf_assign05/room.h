@@ -2,33 +2,264 @@
 #define ROOM_H
 
 #include <string>
-#include <set>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
 #include <pthread.h>
+#include "frame.h"
+#include "user.h"
 
-struct User;
+class Frame;
+class RoomHistory;
+
+// A resumed member's place in catching up (see Room::resume_member):
+// the deliveries [next, end) are still to be sent, after the first
+// names of the room's names (its own and its senders', for members
+// by ID), named of which have gone out.
+struct RetainedCursor {
+  uint64_t next;
+  uint64_t end;
+  size_t names;
+  size_t named;
+
+  RetainedCursor() : next(0), end(0), names(0), named(0) { }
+
+  bool done() const { return next >= end && named >= names; }
+};
+
+// Optional backpressure from a room's receivers to its senders: once
+// the bytes queued for the room's members pass high_water, senders'
+// OKs for sendall are held back until the room drains to low_water,
+// or for at most max_delay_ms (so a stuck receiver slows senders down
+// to one message per max_delay_ms rather than stopping them).
+struct FlowLimits {
+  size_t high_water; // 0 turns flow control off
+  size_t low_water;
+  int max_delay_ms;
+
+  FlowLimits() : high_water(0), low_water(0), max_delay_ms(100) { }
+};
+
+// server-wide flow control counters
+struct FlowStats {
+  std::atomic<unsigned long> held_oks;  // OKs that were held back
+  std::atomic<unsigned long> timeouts;  // ...and released by max_delay_ms
+  std::atomic<unsigned long> held_ms;   // total time they were held
+
+  FlowStats() : held_oks(0), timeouts(0), held_ms(0) { }
+};
 
 // A Room object is a representation of a chat room.
 // At a minimum, it should keep track of the User objects representing
 // receivers who have joined the room.
+//
+// Broadcasts don't take the room lock: membership is published as an
+// immutable snapshot which add_member/remove_member replace (copy on
+// write). A writer waits until every broadcast that could still be
+// using the old snapshot has finished before freeing it, so once
+// remove_member returns nothing will touch the removed User again.
 class Room {
 public:
-  Room(const std::string &room_name);
+  // log_capacity > 0 makes the room keep a log instead of queueing
+  // deliveries to every member (see read_log); with a history every
+  // broadcast is also kept on disk (the room owns it); retain > 0 keeps
+  // that many numbered deliveries for resume_member (not with a log)
+  Room(const std::string &room_name, const FlowLimits &flow = FlowLimits(),
+       size_t log_capacity = 0, RoomHistory *history = nullptr, size_t retain = 0);
   ~Room();
 
   std::string get_room_name() const { return room_name; }
+  uint32_t get_id() const { return id; }
+  RoomHistory *get_history() const { return history; }
 
-  void add_member(User *user);
+  // with history_end, the sequence number of the first broadcast the
+  // user gets live is stored there: everything before it is in the
+  // history, nothing from it on is (needs a history)
+  void add_member(User *user, uint64_t *history_end = nullptr);
   void remove_member(User *user);
 
-  void broadcast_message(const std::string &sender_username, const std::string &message_text);
+  // Resumable receivers: with retain > 0 every broadcast is numbered
+  // (from the history's next sequence number if there is one, so the
+  // numbers are the ones joinsince takes, otherwise from 0) and the
+  // last retain of them are kept in memory. Members with
+  // User::stamped set get each delivery with its number.
+  //
+  // resume_member adds such a member and sets cur to the deliveries
+  // from next on that it missed (up to the first one it gets live; a
+  // next past the newest means there is nothing to catch up on).
+  // read_retained then takes up to max frames of the catch-up, each
+  // with a reference for the caller; what has fallen out of the ring
+  // by then becomes a "missed" marker. Live deliveries should wait in
+  // the queue until cur is done.
+  bool keeps_sequence() const { return !retained.empty(); }
+  void resume_member(User *user, uint64_t next, RetainedCursor &cur);
+  size_t read_retained(User::Format format, RetainedCursor &cur, Frame **frames, size_t max);
+
+  // called when a sender joins: members that get deliveries by ID are
+  // told the sender's name the first time it is seen in this room
+  void add_sender(const User *sender);
+
+  // the text is copied straight into the encoded delivery, so it can
+  // point into a connection's read buffer; text-protocol members don't
+  // get messages a line can't carry (too long, or with a newline).
+  // round (if given) is set to the HistoryFlusher round that has to
+  // complete before the message is on disk, 0 if there is nothing to
+  // wait for. Returns false, having delivered nothing, if the history
+  // is durable (-f) and the message couldn't be written to it.
+  bool broadcast_message(uint32_t sender_id, const char *text, size_t text_len,
+                         uint64_t *round = nullptr);
+
+  // Log mode: a broadcast is one append to a ring of the last
+  // log_capacity deliveries (one frame per format), and each member
+  // only keeps its position in it. read_log takes up to max of the
+  // user's unread deliveries, each with a reference for the caller,
+  // led by a "missed" marker if the ring has wrapped past the user.
+  // When there is nothing to read it returns 0 and the user's queue is
+  // poked at the next append (MessageQueue::poke), so the receiver
+  // waits on its queue as usual. Frames queued to the user directly
+  // (names, at join) should be taken before reading the log.
+  bool has_log() const { return !log.empty(); }
+  size_t read_log(User *user, Frame **frames, size_t max);
+
+  // whether senders' OKs should be held back right now: turns on at
+  // the high watermark and stays on until the low one
+  bool congested();
+  const FlowLimits &flow_limits() const { return flow; }
+
+  // waiting out congestion without polling: the release that brings
+  // the room down to low_water wakes the waiters (see FrameAccount).
+  // wait_uncongested blocks until the room isn't congested (true) or
+  // the monotonic clock reaches deadline_ms (false). notify_drained is
+  // for event loops, which can't block: fn(arg) is called once, from
+  // whichever thread drains the room, unless the room has drained
+  // already, in which case it returns false and nothing is kept.
+  typedef void (*NotifyFn)(void *arg);
+  bool wait_uncongested(long deadline_ms);
+  bool notify_drained(NotifyFn fn, void *arg);
+
+  static FlowStats &flow_stats() { return s_flow_stats; }
 
 private:
+  typedef std::vector<User *> MemberList;
+
+  // members are grouped by format, stamped ones after the others
+  static const int NUM_KINDS = 2 * User::NUM_FORMATS;
+  static int kind(const User *u) { return u->format + (u->stamped ? User::NUM_FORMATS : 0); }
+
+  // what broadcasts read: the members grouped by kind, so each kind
+  // of delivery is encoded once and only if someone in the room needs
+  // it; group k is members[start[k], start[k + 1])
+  struct Snapshot {
+    MemberList members;
+    size_t start[NUM_KINDS + 1];
+
+    Snapshot() { std::fill(start, start + NUM_KINDS + 1, 0); }
+  };
+
+  // readers announce themselves in one of two counters, chosen by the
+  // parity of epoch; a writer flips the epoch and waits for the old
+  // counter to drain (a grace period)
+  const Snapshot *read_begin(unsigned &e);
+  void read_end(unsigned e);
+  void publish(); // lock must be held
+  void join(User *user, bool names = true); // add_member, lock held
+
+  // broadcast_message minus the history; seq is the broadcast's
+  // number, Frame::NO_SEQ if it doesn't get one
+  void deliver(uint32_t sender_id, const char *text, size_t text_len, uint64_t seq);
+
+  // what broadcasts and resumes are ordered by: the history's lock if
+  // there is one (broadcasts hold it anyway), otherwise seq_lock
+  pthread_mutex_t &order_lock();
+
+  // keep the broadcast numbered seq, the next one (frames[k] are the
+  // stamped ones for the members, nullptr where nobody needs them);
+  // order_lock held
+  void retain(uint64_t seq, uint32_t sender_id, const std::string &sender, const char *text,
+              size_t text_len, bool line_ok, const size_t *start, Frame **frames);
+
+  // the retained delivery seq encoded for format, with a reference for
+  // the caller (encoded at most once per entry), or nullptr if it can't
+  // be sent in that format; order_lock held
+  Frame *retained_frame(uint64_t seq, User::Format format);
+
+  // queue a name frame to one user
+  static void send_name(User *user, uint32_t name_id, const std::string &name);
+
+  // queue frame (holding one reference, which this consumes) to n users
+  void fan_out(Frame *frame, User *const *users, size_t n, size_t max_len);
+
+  // log mode: store one broadcast's frames (any may be nullptr, the
+  // references are the log's now) and poke the waiting readers
+  void append_log(Frame *const *frames);
+  void add_log_waiter(User *user); // log_lock must be held
+
   std::string room_name;
-  pthread_mutex_t lock;
+  uint32_t id; // room_name's ID in InternTable::global()
+  pthread_mutex_t lock; // serializes add_member/remove_member/add_sender
+
+  // authoritative membership, guarded by lock: a dense array (so a
+  // snapshot is one contiguous copy) plus each member's position in
+  // it, so removal is an O(1) swap with the last element
+  MemberList members;
+  std::unordered_map<User *, size_t> member_index;
+
+  // senders seen in this room (by ID), guarded by lock
+  std::vector<uint32_t> senders;
+  std::unordered_set<uint32_t> sender_set;
+
+  // bytes of deliveries still sitting in members' queues, only kept
+  // when flow control is on (see Frame::charge)
+  FlowLimits flow;
+  FrameAccount queued;
+  std::atomic<bool> throttling;
+
+  // who is waiting for queued to drop to low_water: blocked senders on
+  // flow_cond, event loops as drain_waiters; guarded by flow_lock
+  pthread_mutex_t flow_lock;
+  pthread_cond_t flow_cond; // on CLOCK_MONOTONIC
+  std::vector<std::pair<NotifyFn, void *>> drain_waiters;
+  static void on_drained(void *arg); // queued's hook
+
+  bool arm_drained(); // flow_lock held: arm the hook, false if drained already
+
+  static FlowStats s_flow_stats;
+
+  // the ring, guarded by log_lock: sequence number s lives in
+  // log[s % log.size()], log_head is the next one to be appended
+  struct LogEntry {
+    Frame *frames[User::NUM_FORMATS];
+  };
+  std::vector<LogEntry> log;
+  uint64_t log_head;
+  std::vector<User *> log_waiters;
+  pthread_mutex_t log_lock;
+
+  // broadcasts are appended and delivered under the history's lock,
+  // so they are kept in the order members get them
+  RoomHistory *history;
 
-  typedef std::set<User *> UserSet;
-  UserSet members;
+  // the last retained.size() numbered deliveries, guarded by
+  // order_lock: sequence number s lives in retained[s % retained.size()]
+  // for s in [seq_tail, seq_head). Each keeps its binary frame, which
+  // the other formats are encoded from when a resume first needs them
+  // (these frames are the ring's own, never charged to flow control).
+  struct Retained {
+    Frame *frames[User::NUM_FORMATS];
+    uint32_t sender_id;
+  };
+  std::vector<Retained> retained;
+  uint64_t seq_head;
+  uint64_t seq_tail;
+  pthread_mutex_t seq_lock;
 
+  std::atomic<const Snapshot *> snapshot;
+  std::atomic<unsigned> epoch;
+  std::atomic<int> readers[2];
 };
 
 #endif // ROOM_H
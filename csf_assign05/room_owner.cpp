@@ -0,0 +1,205 @@
+#include <new>
+#include <algorithm>
+#include <cstring>
+#include <sched.h>
+#include "message.h"
+#include "pool.h"
+#include "guard.h"
+#include "room.h"
+#include "room_owner.h"
+
+// text-protocol sized messages come from here, longer ones from new
+BlockPool RoomOwner::s_job_pool(sizeof(Job) + Message::MAX_LEN);
+
+RoomOwner::RoomOwner()
+  : m_head(&m_stub)
+  , m_tail(&m_stub)
+  , m_pending(0)
+  , m_sleeping(0)
+  , m_full(false) {
+  m_stub.next.store(nullptr, std::memory_order_relaxed);
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_cond_init(&m_cond, nullptr);
+  pthread_cond_init(&m_space, nullptr);
+}
+
+RoomOwner::~RoomOwner() {
+  pthread_cond_destroy(&m_space);
+  pthread_cond_destroy(&m_cond);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool RoomOwner::start() {
+  pthread_t tid;
+  if (pthread_create(&tid, nullptr, thread_main, this) != 0) {
+    return false;
+  }
+  pthread_detach(tid);
+  return true;
+}
+
+void RoomOwner::post(Room *room, uint32_t sender_id, const char *text, size_t text_len) {
+  // a full inbox pushes back on the sender
+  if (full()) {
+    wait_for_space();
+  }
+  enqueue(room, sender_id, text, text_len);
+}
+
+bool RoomOwner::try_post(Room *room, uint32_t sender_id, const char *text, size_t text_len) {
+  if (full()) {
+    return false;
+  }
+  enqueue(room, sender_id, text, text_len);
+  return true;
+}
+
+bool RoomOwner::full() const {
+  return m_full.load() || m_pending.load(std::memory_order_relaxed) >= INBOX_MAX;
+}
+
+void RoomOwner::enqueue(Room *room, uint32_t sender_id, const char *text, size_t text_len) {
+  m_pending.fetch_add(1, std::memory_order_relaxed);
+
+  bool pooled = sizeof(Job) + text_len <= s_job_pool.block_size();
+  void *block = pooled ? s_job_pool.alloc() : ::operator new(sizeof(Job) + text_len);
+  Job *job = new (block) Job;
+  job->room = room;
+  job->sender_id = sender_id;
+  job->text_len = text_len;
+  job->pooled = pooled;
+  memcpy(job->buf(), text, text_len);
+
+  push(job);
+
+  if (m_sleeping.exchange(0)) {
+    Guard g(m_lock);
+    pthread_cond_signal(&m_cond);
+  }
+}
+
+void RoomOwner::wait_for_space() {
+  Guard g(m_lock);
+  if (m_pending.load() >= INBOX_MAX) {
+    m_full.store(true);
+  }
+  while (m_full.load()) {
+    // the owner may have gone past INBOX_LOW before it could see m_full
+    if (m_pending.load() <= INBOX_LOW) {
+      wake_posters();
+      break;
+    }
+    pthread_cond_wait(&m_space, &m_lock);
+  }
+}
+
+bool RoomOwner::notify_space(NotifyFn fn, void *arg) {
+  Guard g(m_lock);
+  m_full.store(true);
+  if (m_pending.load() <= INBOX_LOW) {
+    wake_posters(); // as in wait_for_space
+    return false;
+  }
+  std::pair<NotifyFn, void *> waiter(fn, arg);
+  if (std::find(m_space_waiters.begin(), m_space_waiters.end(), waiter) == m_space_waiters.end()) {
+    m_space_waiters.push_back(waiter);
+  }
+  return true;
+}
+
+void RoomOwner::wake_posters() {
+  // m_lock is held; an event loop's wakeup only takes the loop's own
+  // lock, which is never held while posting
+  m_full.store(false);
+  pthread_cond_broadcast(&m_space);
+  std::vector<std::pair<NotifyFn, void *>> waiters;
+  waiters.swap(m_space_waiters);
+  for (auto &w : waiters) {
+    w.first(w.second);
+  }
+}
+
+void RoomOwner::push(Job *job) {
+  job->next.store(nullptr, std::memory_order_relaxed);
+  Job *prev = m_head.exchange(job); // serializes posters
+  prev->next.store(job, std::memory_order_release);
+}
+
+RoomOwner::Job *RoomOwner::pop() {
+  while (true) {
+    Job *tail = m_tail;
+    Job *next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &m_stub) {
+      if (!next) {
+        if (m_head.load() == tail) {
+          return nullptr;
+        }
+        sched_yield(); // a poster has swung m_head but not linked yet
+        continue;
+      }
+      m_tail = next; // skip over the stub
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (!next) {
+      if (tail != m_head.load()) {
+        sched_yield();
+        continue;
+      }
+      // tail is the last job: put the stub behind it so it can be taken
+      push(&m_stub);
+      next = tail->next.load(std::memory_order_acquire);
+      if (!next) {
+        sched_yield();
+        continue;
+      }
+    }
+
+    m_tail = next;
+    return tail;
+  }
+}
+
+void RoomOwner::free_job(Job *job) {
+  bool pooled = job->pooled;
+  job->~Job();
+  if (pooled) {
+    s_job_pool.free(job);
+  } else {
+    ::operator delete(job);
+  }
+}
+
+void *RoomOwner::thread_main(void *arg) {
+  static_cast<RoomOwner *>(arg)->run();
+  return nullptr;
+}
+
+void RoomOwner::run() {
+  while (true) {
+    Job *job = pop();
+    if (!job) {
+      // announce we're going to sleep, then look once more so a post
+      // that missed the flag isn't left waiting
+      m_sleeping.store(1);
+      job = pop();
+      if (!job) {
+        Guard g(m_lock);
+        while (m_sleeping.load()) {
+          pthread_cond_wait(&m_cond, &m_lock);
+        }
+        continue;
+      }
+      m_sleeping.store(0);
+    }
+
+    job->room->broadcast_message(job->sender_id, job->text(), job->text_len);
+    free_job(job);
+    if (m_pending.fetch_sub(1) - 1 <= INBOX_LOW && m_full.load()) {
+      Guard g(m_lock);
+      wake_posters();
+    }
+  }
+}
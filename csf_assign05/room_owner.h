@@ -0,0 +1,98 @@
+#ifndef ROOM_OWNER_H
+#define ROOM_OWNER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <pthread.h>
+
+class Room;
+class BlockPool;
+
+// A RoomOwner is a thread that runs the broadcasts of the rooms hashed
+// to it (the -r mode). A sender posts its message to the room's owner
+// and gets its OK straight away; the owner fans the posted messages
+// out one at a time. So a room's broadcasts never run concurrently
+// with each other, every member sees the room's messages in the same
+// order (the order they reached the inbox), and the fanout work for a
+// room stays on one core. Joins and leaves still happen on the
+// caller's thread: a room's membership is copy on write anyway, and
+// its grace period covers the owner's broadcasts like any others.
+//
+// The inbox is a Vyukov MPSC list like MessageQueue's, except that a
+// posted message is its own node. It holds at most INBOX_MAX messages;
+// past that, posters sleep until the owner has worked it down to
+// INBOX_LOW, so they wake once per half an inbox rather than per job.
+// Event loops can't sleep, so they use try_post and notify_space.
+class RoomOwner {
+public:
+  RoomOwner();
+  ~RoomOwner(); // only if start failed, a running owner never stops
+
+  bool start();
+
+  // copies the text, may be called from any thread
+  void post(Room *room, uint32_t sender_id, const char *text, size_t text_len);
+
+  // the same, except that it never waits: false, with nothing posted,
+  // if the inbox is full. notify_space then arranges for fn(arg) to be
+  // called once, by the owner, when there is room again, unless there
+  // is already, in which case it returns false and nothing is kept.
+  typedef void (*NotifyFn)(void *arg);
+  bool try_post(Room *room, uint32_t sender_id, const char *text, size_t text_len);
+  bool notify_space(NotifyFn fn, void *arg);
+
+  static const size_t INBOX_MAX = 64 * 1024;
+  static const size_t INBOX_LOW = INBOX_MAX / 2;
+
+private:
+  // value semantics prohibited
+  RoomOwner(const RoomOwner &);
+  RoomOwner &operator=(const RoomOwner &);
+
+  struct Job {
+    std::atomic<Job *> next;
+    Room *room;
+    uint32_t sender_id;
+    size_t text_len;
+    bool pooled;
+    // the text follows the Job in the same block
+    const char *text() const { return reinterpret_cast<const char *>(this + 1); }
+    char *buf() { return reinterpret_cast<char *>(this + 1); }
+  };
+  static BlockPool s_job_pool;
+
+  static void *thread_main(void *arg);
+  void run();
+
+  bool full() const;
+  void enqueue(Room *room, uint32_t sender_id, const char *text, size_t text_len);
+  void wait_for_space();
+  void wake_posters();
+  void push(Job *job);
+  Job *pop(); // nullptr if there is nothing to take right now
+  void free_job(Job *job);
+
+  std::atomic<Job *> m_head;
+  Job *m_tail;
+  Job m_stub;
+
+  std::atomic<size_t> m_pending; // posted but not yet broadcast
+
+  // the owner sleeps on m_cond when the inbox is empty, setting
+  // m_sleeping first so a poster knows to signal
+  std::atomic<int> m_sleeping;
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_cond;
+
+  // set by a poster that found the inbox full, cleared (and m_space
+  // broadcast, space_waiters called, under m_lock) once it is down to
+  // INBOX_LOW
+  std::atomic<bool> m_full;
+  pthread_cond_t m_space;
+  std::vector<std::pair<NotifyFn, void *>> m_space_waiters;
+};
+
+#endif // ROOM_OWNER_H
@@ -0,0 +1,72 @@
+#include <functional>
+#include "guard.h"
+#include "intern.h"
+#include "room.h"
+#include "room_registry.h"
+
+RoomRegistry::RoomRegistry(const FlowLimits &flow, size_t log_capacity,
+                           const HistoryConfig &history, size_t retain)
+  : m_flow(flow)
+  , m_log_capacity(log_capacity)
+  , m_history(history)
+  , m_retain(retain) {
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    pthread_rwlock_init(&m_shards[i].lock, nullptr);
+    pthread_mutex_init(&m_shards[i].create_lock, nullptr);
+  }
+}
+
+RoomRegistry::~RoomRegistry() {
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    for (auto &entry : m_shards[i].rooms) {
+      delete entry.second;
+    }
+    pthread_mutex_destroy(&m_shards[i].create_lock);
+    pthread_rwlock_destroy(&m_shards[i].lock);
+  }
+}
+
+RoomRegistry::Shard &RoomRegistry::shard_for(const std::string &room_name) {
+  return m_shards[std::hash<std::string>()(room_name) % NUM_SHARDS];
+}
+
+Room *RoomRegistry::find(Shard &shard, const std::string &room_name) {
+  pthread_rwlock_rdlock(&shard.lock);
+  auto it = shard.rooms.find(room_name);
+  Room *room = (it != shard.rooms.end()) ? it->second : nullptr;
+  pthread_rwlock_unlock(&shard.lock);
+  return room;
+}
+
+Room *RoomRegistry::find_or_create(const std::string &room_name) {
+  Shard &shard = shard_for(room_name);
+
+  // the common case: the room already exists
+  Room *room = find(shard, room_name);
+  if (room) {
+    return room;
+  }
+
+  // a room's name has to have an ID, and once the table is full a new
+  // room can't get one
+  if (InternTable::global().intern(room_name) == InternTable::NO_ID) {
+    return nullptr;
+  }
+
+  // look again once we're the shard's only creator, someone may have
+  // beaten us to it
+  Guard g(shard.create_lock);
+  room = find(shard, room_name);
+  if (room) {
+    return room;
+  }
+
+  // a history that can't be opened just means the room doesn't keep one
+  RoomHistory *history = m_history.dir.empty() ? nullptr : RoomHistory::open(m_history, room_name);
+  room = new Room(room_name, m_flow, m_log_capacity, history, m_retain);
+
+  pthread_rwlock_wrlock(&shard.lock);
+  shard.rooms.emplace(room_name, room);
+  pthread_rwlock_unlock(&shard.lock);
+  return room;
+}
@@ -0,0 +1,58 @@
+#ifndef ROOM_REGISTRY_H
+#define ROOM_REGISTRY_H
+
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+#include "room.h"
+#include "history.h"
+
+// A RoomRegistry maps room names to Rooms. It is split into shards by
+// a hash of the name, each with its own reader/writer lock, so lookups
+// of different rooms don't contend and lookups of an existing room
+// only take a shared lock. Rooms are never removed, so the Room* that
+// find_or_create returns stays valid without holding any lock.
+//
+// Creating a room can be slow (opening its history means a mkdir and
+// mapping and checking every segment), so it happens under a separate
+// per-shard mutex and the reader/writer lock is only taken for the
+// insert: lookups never wait on the disk.
+class RoomRegistry {
+public:
+  RoomRegistry(const FlowLimits &flow = FlowLimits(), size_t log_capacity = 0,
+               const HistoryConfig &history = HistoryConfig(), size_t retain = 0);
+  ~RoomRegistry();
+
+  // nullptr if the room would be new and its name can't be interned
+  // (the InternTable is full)
+  Room *find_or_create(const std::string &room_name);
+
+private:
+  // value semantics prohibited
+  RoomRegistry(const RoomRegistry &);
+  RoomRegistry &operator=(const RoomRegistry &);
+
+  static const unsigned NUM_SHARDS = 64;
+
+  // padded out to a cache line so neighbouring shard locks don't
+  // bounce the same line between cores
+  struct alignas(64) Shard {
+    pthread_rwlock_t lock;
+    std::unordered_map<std::string, Room *> rooms;
+    // one creation at a time, so a room's history is never opened
+    // twice at once (each would set up the same segment files)
+    pthread_mutex_t create_lock;
+  };
+
+  Room *find(Shard &shard, const std::string &room_name);
+
+  Shard &shard_for(const std::string &room_name);
+
+  FlowLimits m_flow; // every room is created with these
+  size_t m_log_capacity;
+  HistoryConfig m_history; // a room's history is opened when it is created
+  size_t m_retain;
+  Shard m_shards[NUM_SHARDS];
+};
+
+#endif // ROOM_REGISTRY_H
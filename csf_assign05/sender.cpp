@@ -1,25 +1,60 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <deque>
 #include <stdexcept>
+#include <unistd.h>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
+#include "binproto.h"
 #include "client_util.h"
 
+// keep the socket buffers from filling up in both directions at once
+static const int MAX_WINDOW = 256;
+
+static void usage() {
+  std::cerr << "Usage: ./sender [-b] [-w window] [server_address] [port] [username]\n";
+}
+
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    std::cerr << "Usage: ./sender [server_address] [port] [username]\n";
+  // how many requests may be waiting for their reply; 1 is the
+  // classic stop-and-wait client
+  int window = 1;
+  bool binary = false; // ask for binary frames (binproto.h) at login
+
+  int opt;
+  while ((opt = getopt(argc, argv, "bw:")) != -1) {
+    switch (opt) {
+    case 'b':
+      binary = true;
+      break;
+    case 'w':
+      window = std::stoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc - optind != 3 || window < 1 || window > MAX_WINDOW) {
+    usage();
     return 1;
   }
 
+  if (window > 1) {
+    // let cin buffer ahead, so we can tell when no more input is ready
+    std::ios::sync_with_stdio(false);
+  }
+
   std::string server_hostname;
   int server_port;
   std::string username;
 
-  server_hostname = argv[1];
-  server_port = std::stoi(argv[2]);
-  username = argv[3];
+  server_hostname = argv[optind];
+  server_port = std::stoi(argv[optind + 1]);
+  username = argv[optind + 2];
 
   // TODO: connect to server
   Connection conn;
@@ -32,18 +67,39 @@ int main(int argc, char **argv) {
   }
 
   // TODO: send slogin message
-  Message msg(TAG_SLOGIN, username); // supposed ot identify us as sender client to server
+  Message msg(binary ? TAG_SLOGIN_BIN : TAG_SLOGIN, username); // supposed ot identify us as sender client to server
 
   // send the slogin username and then wait for an ok or err
   if (!conn.send(msg) || !conn.receive(msg) || msg.tag == TAG_ERR) {
     std::cerr << msg.data << std::endl;
     return 1;
   }
+  conn.set_binary(binary); // the login reply was the last text line
+
+  // the server answers one connection's requests strictly in order,
+  // so the oldest request still in flight is the one a reply is for
+  std::deque<std::string> in_flight;
+  bool quitting = false;
+
+  // take the reply to the oldest outstanding request
+  auto take_reply = [&]() {
+    if (!conn.receive(msg)) {
+      return false;
+    }
+    if (msg.tag == TAG_ERR) { // given server rej request print an error
+      if (window > 1) {
+        std::cerr << in_flight.front() << ": "; // which line it was for
+      }
+      std::cerr << msg.data << std::endl;
+    }
+    in_flight.pop_front();
+    return true;
+  };
 
   // TODO: loop reading commands from user, sending messages to
   //       server as appropriate
   std::string line;
-    while (std::getline(std::cin, line)) {
+    while (!quitting && std::getline(std::cin, line)) {
       line = trim(line);
       if (line.empty()) { // ignore any empty lines
         continue;
@@ -56,6 +112,7 @@ int main(int argc, char **argv) {
         out = Message(TAG_LEAVE, ""); // to leave the current room you're in
       } else if (line == "/quit") {
         out = Message(TAG_QUIT, ""); // will quit the sesh and notify server
+        quitting = true;
       } else if (line[0] == '/') {
         std::cerr << "The command isn't known to us\n"; // happens when command not known
         continue;
@@ -63,21 +120,35 @@ int main(int argc, char **argv) {
         out = Message(TAG_SENDALL, line); // anything not starting w / is broadcast to room
       }
 
-      // these are for sending message and wait for response
-      // client to wait for ok or err before input accepting
-      if (!conn.send(out)) {
-        break;
-      }
-      if (!conn.receive(msg)) {
+      // with a window of 1 this is plain stop-and-wait: the client
+      // waits for ok or err before accepting more input
+      if (!conn.send_buffered(out)) {
         break;
       }
+      in_flight.push_back(line);
 
-      if (msg.tag == TAG_ERR) { // given server rej request print an error
-        std::cerr << msg.data << std::endl;
-      } else if (out.tag == TAG_QUIT) { // quit tag here for break
+      // only write when the window is full or we have nothing more to
+      // send right away, so a bulk feed goes out in big writes
+      bool more_input = std::cin.rdbuf()->in_avail() > 0;
+      if ((int) in_flight.size() < window && more_input && !quitting) {
+        continue;
+      }
+      if (!conn.flush()) {
         break;
       }
+      while ((int) in_flight.size() >= window && take_reply()) {
+        continue;
+      }
+      if ((int) in_flight.size() >= window) {
+        break; // lost the connection
+      }
     }
 
+  // collect the replies still outstanding
+  conn.flush();
+  while (!in_flight.empty() && take_reply()) {
+    continue;
+  }
+
   return 0;
 }
@@ -4,14 +4,29 @@
 #include <memory>
 #include <set>
 #include <vector>
+#include <algorithm>
+#include <cstring>
 #include <cctype>
 #include <cassert>
+#include <cerrno>
+#include <ctime>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
 #include "message.h"
+#include "binproto.h"
+#include "frame.h"
 #include "connection.h"
 #include "user.h"
 #include "room.h"
 #include "guard.h"
 #include "server.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "room_owner.h"
+#include "history.h"
 
 ////////////////////////////////////////////////////////////////////////
 // Server implementation data types
@@ -25,51 +40,161 @@
 
 namespace {
 
+// a receiver that has fallen behind gets its backlog in one writev,
+// up to this many frames or bytes at a time
+const int DRAIN_MAX_FRAMES = 64;
+const size_t DRAIN_MAX_BYTES = 64 * 1024;
+
+// binary deliveries carry names with a one byte length, and a text
+// line couldn't hold a longer one anyway
+const size_t MAX_NAME_LEN = 255;
+
+// "N:rest" (joinlast/joinsince/resume): take N off the front of data
+bool take_count(const char*& data, size_t& len, uint64_t& count) {
+  const char* sep = static_cast<const char*>(memchr(data, ':', len));
+  if (!sep || sep == data || sep - data > 19) {
+    return false;
+  }
+  count = 0;
+  for (const char* p = data; p < sep; p++) {
+    if (!isdigit(static_cast<unsigned char>(*p))) {
+      return false;
+    }
+    count = count * 10 + (*p - '0');
+  }
+  len -= sep + 1 - data;
+  data = sep + 1;
+  return true;
+}
+
+// write n frames out in one go and drop our references to them
+bool send_frames(Connection* conn, Frame** frames, struct iovec* iov, int n) {
+  // frames are already encoded by the broadcast, written out as is
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = const_cast<char*>(frames[i]->data());
+    iov[i].iov_len = frames[i]->size();
+  }
+  bool sent = conn->send_iov(iov, n);
+
+  for (int i = 0; i < n; i++) {
+    frames[i]->release();
+  }
+  return sent;
+}
+
+long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// hold a sender's OK until its room drains to the low watermark or the
+// room's max delay is up (event loops do the same without blocking)
+void wait_for_room(Room* room) {
+  FlowStats& stats = Room::flow_stats();
+  long start = now_ms();
+
+  stats.held_oks++;
+  if (!room->wait_uncongested(start + room->flow_limits().max_delay_ms)) {
+    stats.timeouts++;
+  }
+  stats.held_ms += now_ms() - start;
+}
+
+// an acceptor takes up to this many connections per wakeup
+const int ACCEPT_BATCH = 64;
+
+// open_listenfd, but with SO_REUSEPORT on request so several sockets
+// can listen on the same port, the kernel spreading connections
+// between them
+int open_listener(const char* port, bool reuseport) {
+  struct addrinfo hints, *listp, *p;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(nullptr, port, &hints, &listp) != 0) {
+    return -1;
+  }
+
+  int lfd = -1;
+  for (p = listp; p; p = p->ai_next) {
+    lfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+    if (lfd < 0) {
+      continue;
+    }
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport) {
+      setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    }
+    if (bind(lfd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(lfd);
+    lfd = -1;
+  }
+  freeaddrinfo(listp);
+
+  if (lfd >= 0 && ::listen(lfd, LISTENQ) < 0) {
+    close(lfd);
+    lfd = -1;
+  }
+  return lfd;
+}
+
+// write out a sender's buffered replies, once the group commit the
+// OKs among them wait for (if any) has completed
+bool flush_replies(Server::client_info* c) {
+  HistoryFlusher::global().wait_for(c->commit_round);
+  return c->conn->flush();
+}
+
+struct acceptor_args {
+  Server* server;
+  int lfd;
+};
+
 struct worker_args {
   Server* server;
   Server::client_info* info;
 };
 
-void* worker(void* arg) {
-  pthread_detach(pthread_self());
-
+// one whole session: login, then chat until the client is done
+void run_session(void* arg) {
   worker_args* w = static_cast<worker_args*>(arg);
   Server* srv = w->server;
   Server::client_info* c = w->info;
   delete w;
 
-  Message login;
+  MessageView login;
 
-  if (!c->conn->receive(login)) {
+  if (!c->conn->receive_view(login)) {
     std::cerr << "[worker] login recv fail\n";
-    close(c->sockfd);
     delete c->conn;
     delete c;
-    return nullptr;
+    return;
   }
 
-  if (login.tag == TAG_SLOGIN) {
-    c->role = 'S';
-    c->uname = login.data;
-    c->user = new User(login.data);
-    c->conn->send(Message(TAG_OK, "ok"));
+  Message reply;
+  bool ok = srv->handle_login(c, login, reply);
+  c->conn->send(reply);
+  c->conn->set_binary(ok && c->binary);
+
+  if (ok && c->role == 'S') {
     srv->chat_with_sender(c);
   }
-  else if (login.tag == TAG_RLOGIN) {
-    c->role = 'R';
-    c->uname = login.data;
-    c->user = new User(login.data);
-    c->conn->send(Message(TAG_OK, "ok"));
+  else if (ok && c->role == 'R') {
     srv->chat_with_receiver(c);
   }
-  else {
-    c->conn->send(Message(TAG_ERR, "invalid login"));
-    close(c->sockfd);
-    delete c->conn;
-    delete c;
-    return nullptr;
-  }
 
+  srv->end_session(c);
+  delete c->conn; // closes the socket
+  delete c;
+}
+
+void* worker(void* arg) {
+  pthread_detach(pthread_self());
+  run_session(arg);
   return nullptr;
 }
 
@@ -80,14 +205,15 @@ void* worker(void* arg) {
 // Server member function implementation
 ////////////////////////////////////////////////////////////////////////
 
-Server::Server(int port)
-  : m_port(port), m_ssock(-1)
+Server::Server(int port, const ServerConfig &config)
+  : m_port(port), m_config(config)
+  , m_rooms(config.flow, config.room_log, config.history, config.room_retain)
+  , m_pool(nullptr), m_next_loop(0)
 {
-  pthread_mutex_init(&m_lock, nullptr);
 }
 
 Server::~Server() {
-  pthread_mutex_destroy(&m_lock);
+  delete m_pool;
 }
 
 bool Server::listen() {
@@ -95,10 +221,15 @@ bool Server::listen() {
   ss << m_port;
   std::string pstr = ss.str();
 
-  m_ssock = open_listenfd(pstr.c_str());
-  if (m_ssock < 0) {
-    std::cerr << "listenfd fail\n";
-    return false;
+  // each acceptor gets a listener (and accept queue) of its own
+  int n = std::max(m_config.acceptors, 1);
+  for (int i = 0; i < n; i++) {
+    int lfd = open_listener(pstr.c_str(), n > 1);
+    if (lfd < 0) {
+      std::cerr << "listenfd fail\n";
+      return false;
+    }
+    m_lsocks.push_back(lfd);
   }
 
   std::cout << "[server] listening on port " << m_port << "\n";
@@ -106,134 +237,505 @@ bool Server::listen() {
 }
 
 void Server::handle_client_requests() {
-  while (true) {
-    int cfd = Accept(m_ssock, nullptr, nullptr);
+  if (m_config.pool_threads > 0 && m_config.event_threads <= 0) {
+    m_pool = new WorkerPool(m_config.pool_threads);
+    if (!m_pool->start()) {
+      std::cerr << "[server] could not start the worker pool\n";
+      if (m_pool->started() > 0) {
+        m_pool = nullptr; // left to the workers that did start, never freed
+      }
+      return;
+    }
+    std::cout << "[server] " << m_pool->size() << " worker thread(s)\n";
+  }
 
-    if (cfd < 0) {
-      std::cerr << "[server] accept fail\n";
-      continue;
+  for (int i = 0; i < m_config.room_owners; i++) {
+    RoomOwner* owner = new RoomOwner;
+    if (!owner->start()) {
+      std::cerr << "[server] could not start a room owner\n";
+      delete owner;
+      return;
     }
+    m_owners.push_back(owner);
+  }
+  if (!m_owners.empty()) {
+    std::cout << "[server] " << m_owners.size() << " room owner thread(s)\n";
+  }
+
+  if (m_config.history.durability == HistoryConfig::GROUP) {
+    // before the event loops, which listen to it
+    if (!HistoryFlusher::global().start(m_config.history)) {
+      std::cerr << "[server] could not start the history flusher\n";
+      return;
+    }
+  }
 
-    auto* ci = new client_info;
-    ci->sockfd = cfd;
-    ci->conn = new Connection(cfd);
+  if (m_config.stats_interval > 0) {
+    pthread_t tid;
+    if (pthread_create(&tid, nullptr, stats_main, this) == 0) {
+      pthread_detach(tid);
+    }
+  }
 
-    auto* pkg = new worker_args{this, ci};
+  if (m_config.event_threads > 0 && !start_event_loops()) {
+    return;
+  }
 
+  // the calling thread is the first acceptor
+  for (size_t i = 1; i < m_lsocks.size(); i++) {
     pthread_t tid;
-    if (pthread_create(&tid, nullptr, worker, pkg) != 0) {
-      std::cerr << "[server] thread fail\n";
+    auto* args = new acceptor_args{this, m_lsocks[i]};
+    if (pthread_create(&tid, nullptr, acceptor_main, args) != 0) {
+      std::cerr << "[server] acceptor thread fail\n";
+      delete args;
+      continue;
     }
+    pthread_detach(tid);
+  }
+  if (m_lsocks.size() > 1) {
+    std::cout << "[server] " << m_lsocks.size() << " acceptor thread(s)\n";
   }
+  accept_loop(m_lsocks[0]);
 }
 
-Room* Server::find_or_create_room(const std::string& room_name) {
-  if (m_rooms.count(room_name) == 0) {
-    Room* r = new Room(room_name);
-    m_rooms[room_name] = r;
+void *Server::acceptor_main(void *arg) {
+  acceptor_args *a = static_cast<acceptor_args *>(arg);
+  Server *srv = a->server;
+  int lfd = a->lfd;
+  delete a;
+  srv->accept_loop(lfd);
+  return nullptr;
+}
+
+void Server::accept_loop(int lfd) {
+  // event loops want non-blocking sockets, the threaded modes read
+  // through rio and want blocking ones
+  int flags = SOCK_CLOEXEC | (m_loops.empty() ? 0 : SOCK_NONBLOCK);
+
+  struct pollfd pfd;
+  pfd.fd = lfd;
+  pfd.events = POLLIN;
+
+  while (true) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      std::cerr << "[server] poll fail\n";
+      return;
+    }
+
+    // the listener is non-blocking, so take everything that is already
+    // waiting (up to a batch) before sleeping again
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+      int cfd = accept4(lfd, nullptr, nullptr, flags);
+      if (cfd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break; // drained
+        }
+        if (errno != EINTR && errno != ECONNABORTED) {
+          std::cerr << "[server] accept fail\n";
+        }
+        continue;
+      }
+      dispatch(cfd);
+    }
   }
-  return m_rooms[room_name];
+}
+
+void Server::dispatch(int cfd) {
+  if (!m_loops.empty()) {
+    // all reading and writing happens on the loop threads
+    m_loops[m_next_loop.fetch_add(1, std::memory_order_relaxed) % m_loops.size()]->add_connection(cfd);
+    return;
+  }
+
+  auto* ci = new client_info;
+  ci->sockfd = cfd;
+  ci->conn = new Connection(cfd);
+
+  auto* pkg = new worker_args{this, ci};
+
+  if (m_pool) {
+    // queued, never waits: with every worker in a long-lived session
+    // this one doesn't start until one of those ends, however long
+    // that takes (see WorkerPool)
+    m_pool->submit(run_session, pkg);
+    return;
+  }
+
+  pthread_t tid;
+  if (pthread_create(&tid, nullptr, worker, pkg) != 0) {
+    std::cerr << "[server] thread fail\n";
+  }
+}
+
+void *Server::stats_main(void *arg) {
+  Server *srv = static_cast<Server *>(arg);
+  const QueueStats &q = MessageQueue::stats();
+
+  while (true) {
+    sleep(srv->m_config.stats_interval);
+    std::cerr << "[stats] queues:"
+              << " dropped_newest=" << q.dropped_newest.load()
+              << " dropped_oldest=" << q.dropped_oldest.load()
+              << " disconnects=" << q.disconnects.load()
+              << " dropped_cut=" << q.dropped_cut.load()
+              << " gap_markers=" << q.gap_markers.load()
+              << " spilled=" << q.spilled.load()
+              << " unspilled=" << q.unspilled.load() << "\n";
+    if (srv->m_config.flow.high_water) {
+      const FlowStats &f = Room::flow_stats();
+      std::cerr << "[stats] flow:"
+                << " held_oks=" << f.held_oks.load()
+                << " timeouts=" << f.timeouts.load()
+                << " held_ms=" << f.held_ms.load() << "\n";
+    }
+    if (HistoryFlusher::global().running()) {
+      const HistoryFlusher &h = HistoryFlusher::global();
+      std::cerr << "[stats] commit:"
+                << " rounds=" << h.rounds()
+                << " syncs=" << h.syncs()
+                << " appends=" << h.appends() << "\n";
+    }
+    if (srv->m_pool) {
+      WorkerPool *p = srv->m_pool;
+      std::cerr << "[stats] pool:"
+                << " busy=" << p->busy() << "/" << p->size()
+                << " sessions_done=" << p->tasks()
+                << " steals=" << p->steals() << "\n";
+    }
+  }
+  return nullptr;
+}
+
+bool Server::start_event_loops() {
+  // every idle connection costs a descriptor rather than a thread in
+  // this mode, so let the process have as many as it is allowed
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  for (int i = 0; i < m_config.event_threads; i++) {
+    EventLoop* loop = new EventLoop(this);
+    if (!loop->start()) {
+      std::cerr << "[server] event loop start fail\n";
+      delete loop;
+      break;
+    }
+    m_loops.push_back(loop);
+  }
+  if (m_loops.empty()) {
+    return false;
+  }
+
+  std::cout << "[server] " << m_loops.size() << " event loop thread(s)\n";
+  return true;
+}
+
+RoomOwner* Server::owner_of(const Room* room) const {
+  // the room's interned ID stands in for its name, mixed so that
+  // rooms created one after another don't all land together
+  uint32_t h = room->get_id() * 2654435761u;
+  return m_owners[(h >> 16) % m_owners.size()];
+}
+
+Room* Server::find_or_create_room(const std::string& room_name) {
+  return m_rooms.find_or_create(room_name);
 }
 
 ////////////////////////////////////////////////////////////////////////
-// Sender + Receiver communication logic
+// Protocol handling (shared by both server modes)
 ////////////////////////////////////////////////////////////////////////
 
-void Server::chat_with_sender(client_info* c) {
-  while (true) {
-    Message msg;
+bool Server::handle_login(client_info* c, const MessageView& msg, Message& reply) {
+  // the b and i variants ask for binary frames once this reply is sent
+  bool ids = msg.tag_is(TAG_RLOGIN_IDS);
+  c->binary = msg.tag_is(TAG_SLOGIN_BIN) || msg.tag_is(TAG_RLOGIN_BIN) || ids;
+
+  if (msg.tag_is(TAG_SLOGIN) || msg.tag_is(TAG_RLOGIN) || c->binary) {
+    c->role = (msg.tag_is(TAG_SLOGIN) || msg.tag_is(TAG_SLOGIN_BIN)) ? 'S' : 'R';
+    c->uname = msg.data_str();
+    c->user = new User(c->uname);
+    c->user->format = ids ? User::BINARY_IDS : c->binary ? User::BINARY : User::TEXT;
+    if (c->role == 'R') {
+      c->user->mqueue.set_limits(m_config.queue_limits);
+      c->user->mqueue.set_receiver(c->sockfd, c->binary);
+    }
+    reply.set(TAG_OK, "ok");
+    return true;
+  }
 
-    if (!c->conn->receive(msg)) {
-      std::cerr << "[sender] read fail\n";
-      close(c->sockfd);
-      return;
+  reply.set(TAG_ERR, "invalid login");
+  return false;
+}
+
+bool Server::handle_sender_message(client_info* c, const MessageView& msg, Message& reply) {
+  // JOIN (senders are not room members, only receivers get deliveries)
+  if (msg.tag_is(TAG_JOIN)) {
+    if (msg.data_len > MAX_NAME_LEN) {
+      reply.set(TAG_ERR, "room name too long");
+      return true;
+    }
+    if (c->user->id == InternTable::NO_ID) {
+      c->user->id = InternTable::global().intern(c->uname);
     }
+    Room* room = (c->user->id != InternTable::NO_ID) ? find_or_create_room(msg.data_str()) : nullptr;
+    if (!room) {
+      reply.set(TAG_ERR, "too many names");
+      return true;
+    }
+    c->room = room;
+    c->room->add_sender(c->user);
+    reply.set(TAG_OK, msg.data, msg.data_len);
+  }
 
-    // JOIN
-    if (msg.tag == TAG_JOIN) {
-      pthread_mutex_lock(&m_lock);
-      c->room = find_or_create_room(msg.data);
-      c->room->add_member(c->user);
-      c->conn->send(Message(TAG_OK, msg.data));
-      pthread_mutex_unlock(&m_lock);
+  // SENDALL
+  else if (msg.tag_is(TAG_SENDALL)) {
+    if (!c->room) {
+      reply.set(TAG_ERR, "not in room");
+      return true;
     }
 
-    // SENDALL
-    else if (msg.tag == TAG_SENDALL) {
-      if (!c->room) {
-        c->conn->send(Message(TAG_ERR, "not in room"));
-        return;
+    if (!m_owners.empty()) {
+      // the room's owner fans it out, in the order it gets them
+      RoomOwner* owner = owner_of(c->room);
+      if (!c->never_wait) {
+        owner->post(c->room, c->user->id, msg.data, msg.data_len);
+      } else if (!owner->try_post(c->room, c->user->id, msg.data, msg.data_len)) {
+        c->owner_full = owner; // no reply, the caller tries again later
+        return true;
+      }
+    } else {
+      // only the room's own lock is involved, other rooms aren't affected
+      uint64_t round;
+      if (!c->room->broadcast_message(c->user->id, msg.data, msg.data_len, &round)) {
+        reply.set(TAG_ERR, "message not saved");
+        return true;
       }
+      c->commit_round = std::max(c->commit_round, round);
+    }
 
-      pthread_mutex_lock(&m_lock);
-      c->room->broadcast_message(c->uname, msg.data);
-      pthread_mutex_unlock(&m_lock);
+    reply.set(TAG_OK, msg.data, msg.data_len);
+  }
 
-      c->conn->send(Message(TAG_OK, msg.data));
+  // LEAVE
+  else if (msg.tag_is(TAG_LEAVE)) {
+    if (!c->room) {
+      reply.set(TAG_ERR, "not in room");
+      return true;
     }
 
-    // LEAVE
-    else if (msg.tag == TAG_LEAVE) {
-      if (!c->room) {
-        c->conn->send(Message(TAG_ERR, "not in room"));
-        return;
-      }
+    c->room = nullptr;
+    reply.set(TAG_OK, msg.data, msg.data_len);
+  }
+
+  // QUIT
+  else if (msg.tag_is(TAG_QUIT)) {
+    reply.set(TAG_OK, "bye");
+    return false;
+  }
 
-      c->room->remove_member(c->user);
-      c->room = nullptr;
-      c->conn->send(Message(TAG_OK, msg.data));
+  // ERR
+  else if (msg.tag_is(TAG_ERR)) {
+    reply.set(TAG_ERR, "err");
+    return false;
+  }
+
+  else {
+    reply.set(TAG_ERR, "invalid tag");
+  }
+
+  return true;
+}
+
+bool Server::handle_receiver_message(client_info* c, const MessageView& msg, Message& reply) {
+  bool last = msg.tag_is(TAG_JOIN_LAST);
+  bool since = msg.tag_is(TAG_JOIN_SINCE);
+  bool resume = msg.tag_is(TAG_RESUME);
+  bool stamped = resume || msg.tag_is(TAG_JOIN_SEQ);
+  if (msg.tag_is(TAG_JOIN) || last || since || stamped) {
+    const char* name = msg.data;
+    size_t name_len = msg.data_len;
+    uint64_t count = 0;
+    if ((last || since || resume) && !take_count(name, name_len, count)) {
+      reply.set(TAG_ERR, "invalid history request");
+      return false;
+    }
+    if (name_len > MAX_NAME_LEN) {
+      reply.set(TAG_ERR, "room name too long");
+      return false;
+    }
+    Room* room = find_or_create_room(std::string(name, name_len));
+    if (!room) {
+      reply.set(TAG_ERR, "too many names");
+      return false;
     }
 
-    // QUIT
-    else if (msg.tag == TAG_QUIT) {
-      c->conn->send(Message(TAG_OK, "bye"));
-      close(c->sockfd);
+    if (stamped) {
+      if (!room->keeps_sequence()) {
+        reply.set(TAG_ERR, "rooms aren't numbered (no -R)");
+        return false;
+      }
+      // resume gives the last number seen, everything after it goes first
+      c->room = room;
+      c->user->stamped = true;
+      room->resume_member(c->user, resume ? count + 1 : UINT64_MAX, c->resume);
+      reply.set(TAG_OK, name, name_len);
+      return true;
+    }
+    c->room = room;
+
+    // a room without history just has nothing to replay
+    RoomHistory* history = (last || since) ? c->room->get_history() : nullptr;
+    uint64_t end = 0;
+    c->room->add_member(c->user, history ? &end : nullptr);
+    if (history) {
+      uint64_t start = last ? end - std::min(count, end) : std::min(count, end);
+      c->replay = new HistoryCursor(history, start, end, c->user->format,
+                                    c->room->get_id(), since);
+    }
+    reply.set(TAG_OK, name, name_len);
+    return true;
+  }
+  else if (msg.tag_is(TAG_ERR)) {
+    reply.set(TAG_ERR, msg.data, msg.data_len);
+  }
+  else {
+    reply.set(TAG_ERR, "invalid tag");
+  }
+  return false;
+}
+
+bool Server::should_hold_reply(client_info* c, const MessageView& msg) {
+  return msg.tag_is(TAG_SENDALL) && c->room && c->room->congested();
+}
+
+void Server::end_session(client_info* c) {
+  // once remove_member returns no broadcast can still be
+  // enqueueing to this user, so it is safe to free it
+  if (c->room && c->role == 'R') {
+    c->room->remove_member(c->user);
+  }
+  c->room = nullptr;
+
+  delete c->replay;
+  c->replay = nullptr;
+  delete c->user;
+  c->user = nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Sender + Receiver communication logic
+////////////////////////////////////////////////////////////////////////
+
+void Server::chat_with_sender(client_info* c) {
+  Message reply; // reused, so steady state replies don't allocate
+
+  while (true) {
+    MessageView msg;
+
+    if (!c->conn->receive_view(msg)) {
+      std::cerr << "[sender] read fail\n";
       return;
     }
 
-    // ERR
-    else if (msg.tag == TAG_ERR) {
-      c->conn->send(Message(TAG_ERR, "err"));
+    bool keep_going = handle_sender_message(c, msg, reply);
+
+    if (should_hold_reply(c, msg)) {
+      // let the sender have its earlier OKs, just not this one
+      if (!flush_replies(c)) {
+        return;
+      }
+      wait_for_room(c->room);
+    }
+
+    // a pipelining sender may already have more requests waiting, so
+    // only write the replies out once we'd have to block for input (and
+    // their messages then share a group commit)
+    if (!c->conn->send_buffered(reply)) {
       return;
     }
+    if (!keep_going || !c->conn->has_buffered_message()) {
+      if (!flush_replies(c) || !keep_going) {
+        return;
+      }
+    }
   }
 }
 
 
 void Server::chat_with_receiver(client_info* c) {
-  Message first;
+  MessageView first;
 
-  if (!c->conn->receive(first)) {
-    close(c->sockfd);
+  if (!c->conn->receive_view(first)) {
     return;
   }
 
-  bool joined = false;
+  Message reply;
+  bool joined = handle_receiver_message(c, first, reply);
+  c->conn->send(reply);
 
-  if (first.tag == TAG_JOIN) {
-    pthread_mutex_lock(&m_lock);
-    c->room = find_or_create_room(first.data);
-    c->room->add_member(c->user);
-    c->conn->send(Message(TAG_OK, first.data));
-    pthread_mutex_unlock(&m_lock);
-    joined = true;
-  }
-  else if (first.tag == TAG_ERR) {
-    c->conn->send(Message(TAG_ERR, first.data));
-    return;
+  Frame* batch[DRAIN_MAX_FRAMES];
+  struct iovec iov[DRAIN_MAX_FRAMES];
+
+  // history asked for at join goes out ahead of anything live, which
+  // waits in the queue (or the log) meanwhile
+  if (joined && c->replay) {
+    int n;
+    while ((n = c->replay->history->read(*c->replay, iov, DRAIN_MAX_FRAMES, DRAIN_MAX_BYTES)) > 0) {
+      if (!c->conn->send_iov(iov, n)) {
+        return;
+      }
+    }
+    delete c->replay;
+    c->replay = nullptr;
   }
-  else {
-    c->conn->send(Message(TAG_ERR, "invalid tag"));
-    return;
+
+  // likewise what a resume missed, from the room's ring
+  while (joined && !c->resume.done()) {
+    int n = int(c->room->read_retained(c->user->format, c->resume, batch, DRAIN_MAX_FRAMES));
+    if (!send_frames(c->conn, batch, iov, n)) {
+      return;
+    }
   }
 
+  Room* log_room = (joined && c->room->has_log()) ? c->room : nullptr;
+
   while (joined) {
-    Message* pending = c->user->mqueue.dequeue();
-    if (!pending) continue;
+    int n = 0;
+    size_t bytes = 0;
+    if (!log_room) {
+      // sleeps until there is a delivery or the client goes away
+      batch[0] = c->user->mqueue.dequeue(c->sockfd);
+      if (!batch[0]) {
+        return; // hung up, end_session takes us out of the room
+      }
+      n = 1;
+      bytes = batch[0]->size();
+    }
 
-    pending->tag = TAG_DELIVERY;
-    c->conn->send(*pending);
+    // take whatever else is already queued along with it
+    while (n < DRAIN_MAX_FRAMES && bytes < DRAIN_MAX_BYTES) {
+      Frame* more = c->user->mqueue.try_dequeue();
+      if (!more) break;
+      batch[n++] = more;
+      bytes += more->size();
+    }
+
+    // in log mode the deliveries themselves come from the room's log
+    if (log_room && n < DRAIN_MAX_FRAMES) {
+      n += log_room->read_log(c->user, batch + n, DRAIN_MAX_FRAMES - n);
+      if (n == 0) {
+        // read_log will have us poked at the next append
+        if (!c->user->mqueue.wait(c->sockfd)) {
+          return;
+        }
+        continue;
+      }
+    }
 
-    delete pending;
+    if (!send_frames(c->conn, batch, iov, n)) {
+      return;
+    }
   }
 }
@@ -1,17 +1,47 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <map>
 #include <string>
+#include <vector>
+#include <atomic>
 #include <pthread.h>
+#include "room_registry.h"
+#include "message_queue.h"
 
 class Room;
 class Connection;
-class User;
+class EventLoop;
+class WorkerPool;
+class RoomOwner;
+struct HistoryCursor;
+struct Message;
+struct MessageView;
+struct User;
+
+// server-wide settings, filled in from the command line by server_main
+struct ServerConfig {
+  int event_threads; // > 0 selects the epoll event-loop mode with this many loops
+  int pool_threads;  // > 0 runs sessions on a fixed pool of this many threads
+  int acceptors;     // accepting threads, each with its own SO_REUSEPORT listener
+  int room_owners;   // > 0 hands each room's broadcasts to one of this many threads
+  size_t room_log;   // > 0 gives each room a log of this many deliveries instead of member queues
+  QueueLimits queue_limits; // applied to every receiver's queue, unbounded unless -l/-m
+  int stats_interval; // > 0 prints the counters to stderr this often (seconds)
+  FlowLimits flow; // sender backpressure per room, off unless high_water is set
+  HistoryConfig history; // rooms' broadcasts kept on disk, off unless dir is set
+  size_t room_retain; // > 0 numbers deliveries and keeps this many per room for resume
+
+  ServerConfig() : event_threads(0), pool_threads(0), acceptors(1), room_owners(0)
+    , room_log(0), stats_interval(0), room_retain(0) {
+    // only matters once a limit is set: the receiver keeps its session
+    // and is told what it missed
+    queue_limits.policy = QueueLimits::MARK_GAP;
+  }
+};
 
 class Server {
 public:
-  Server(int port);
+  Server(int port, const ServerConfig &config = ServerConfig());
   ~Server();
 
   bool listen();
@@ -26,15 +56,39 @@ public:
       pthread_t tid;
       Room* room;
       User* user;
+      bool binary; // logged in with bslogin/brlogin
+      HistoryCursor* replay; // history asked for at join, not sent yet
+      uint64_t commit_round; // the group commit the OKs so far wait for (-f group)
+      RetainedCursor resume; // what a resume missed, not sent yet
+      bool never_wait; // event loops: a sendall to a full room owner isn't taken...
+      RoomOwner* owner_full; // ...and this says whose inbox to wait for (-r)
       client_info() :
         sockfd(-1), role('?'),
         conn(nullptr), tid(0),
-        room(nullptr), user(nullptr) {}
+        room(nullptr), user(nullptr),
+        binary(false), replay(nullptr), commit_round(0),
+        never_wait(false), owner_full(nullptr) {}
   };
 
   void chat_with_sender(client_info* c);
   void chat_with_receiver(client_info* c);
 
+  // protocol logic shared by the threaded and event-loop modes: each
+  // takes one decoded request (still in the connection's read buffer)
+  // and fills in the reply to send back, returning false if the
+  // session should end after that reply
+  bool handle_login(client_info* c, const MessageView& msg, Message& reply);
+  bool handle_sender_message(client_info* c, const MessageView& msg, Message& reply);
+  bool handle_receiver_message(client_info* c, const MessageView& msg, Message& reply);
+
+  // flow control: true if the reply to this sender request should be
+  // held back because it put more into a room that is over its high
+  // watermark (see FlowLimits)
+  bool should_hold_reply(client_info* c, const MessageView& msg);
+
+  // leave the current room and free the session's User
+  void end_session(client_info* c);
+
   Room* find_or_create_room(const std::string& room_name);
 
 private:
@@ -42,14 +96,23 @@ private:
   Server(const Server&) = delete;
   Server& operator=(const Server&) = delete;
 
-  using RoomMap = std::map<std::string, Room*>;
+  bool start_event_loops();
+  static void *acceptor_main(void *arg);
+  void accept_loop(int lfd);
+  void dispatch(int cfd); // hand an accepted socket to whichever mode runs it
+  RoomOwner* owner_of(const Room* room) const;
+  static void *stats_main(void *arg);
 
   // These member variables are sufficient for implementing
   // the server operations
   int m_port;
-  int m_ssock;
-  RoomMap m_rooms;
-  pthread_mutex_t m_lock;
+  std::vector<int> m_lsocks; // one listener per acceptor
+  ServerConfig m_config;
+  RoomRegistry m_rooms; // sharded, so there is no server-wide lock
+  WorkerPool* m_pool;   // session threads, if pool_threads is set
+  std::vector<EventLoop*> m_loops; // in event-loop mode
+  std::atomic<unsigned> m_next_loop; // round-robin over m_loops
+  std::vector<RoomOwner*> m_owners; // broadcast threads, if room_owners is set
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,25 +1,186 @@
 #include <iostream>
 #include <csignal>
+#include <string>
+#include <unistd.h>
 #include "server.h"
 
 // If you implement the Server class as described by its
 // TODO comments, you should not need to make any changes
 // to this main function.
 
+static void usage() {
+  std::cerr << "Usage: server_main [-e event_threads | -p pool_threads] [-a acceptors]\n"
+               "                   [-r room_owners] [-g room_log_entries | -R retained_entries]\n"
+               "                   [-l max_queued] [-m max_queued_bytes]\n"
+               "                   [-o drop-newest|drop-oldest|disconnect|mark|spill [-P spill_dir]]\n"
+               "                   [-s stats_secs]\n"
+               "                   [-H room_high_water [-L room_low_water] [-d max_delay_ms]]\n"
+               "                   [-D history_dir [-S segment_mb] [-K keep_mb] [-T keep_secs]\n"
+               "                    [-f none|group|each [-F commit_ms] [-b commit_kb]]] <port>\n"
+               "  (queues are unbounded unless -l/-m are given, -H turns on sender flow control,\n"
+               "   -D keeps every room's messages for joinlast/joinsince, -f makes\n"
+               "   senders' OKs wait until their messages are on disk, -R numbers\n"
+               "   deliveries for sjoin/resume, -o spill writes the oldest deliveries\n"
+               "   of a receiver over its limits to a file in spill_dir)\n";
+}
+
+static bool parse_durability(const std::string &name, HistoryConfig::Durability &durability) {
+  if (name == "none") {
+    durability = HistoryConfig::BUFFERED;
+  } else if (name == "group") {
+    durability = HistoryConfig::GROUP;
+  } else if (name == "each") {
+    durability = HistoryConfig::EACH;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool parse_policy(const std::string &name, QueueLimits::Policy &policy) {
+  if (name == "drop-newest") {
+    policy = QueueLimits::DROP_NEWEST;
+  } else if (name == "drop-oldest") {
+    policy = QueueLimits::DROP_OLDEST;
+  } else if (name == "disconnect") {
+    policy = QueueLimits::DISCONNECT;
+  } else if (name == "mark") {
+    policy = QueueLimits::MARK_GAP;
+  } else if (name == "spill") {
+    policy = QueueLimits::SPILL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: server_main <port>\n";
+  ServerConfig config;
+
+  bool low_set = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:b:d:D:e:f:F:g:H:K:l:L:m:o:p:P:r:R:s:S:T:")) != -1) {
+    switch (opt) {
+    case 'a':
+      config.acceptors = std::stoi(optarg); // SO_REUSEPORT listeners
+      break;
+    case 'b':
+      config.history.commit_bytes = std::stoul(optarg) << 10;
+      break;
+    case 'd':
+      config.flow.max_delay_ms = std::stoi(optarg);
+      break;
+    case 'D':
+      config.history.dir = optarg; // rooms' broadcasts kept on disk
+      break;
+    case 'e':
+      config.event_threads = std::stoi(optarg); // epoll event-loop mode
+      break;
+    case 'f':
+      if (!parse_durability(optarg, config.history.durability)) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'F':
+      config.history.commit_ms = std::stoi(optarg);
+      break;
+    case 'g':
+      config.room_log = std::stoul(optarg); // rooms keep a log, not member queues
+      break;
+    case 'H':
+      config.flow.high_water = std::stoul(optarg);
+      break;
+    case 'K':
+      config.history.retain_bytes = std::stoul(optarg) << 20;
+      break;
+    case 'l':
+      config.queue_limits.max_frames = std::stoul(optarg);
+      break;
+    case 'L':
+      config.flow.low_water = std::stoul(optarg);
+      low_set = true;
+      break;
+    case 'm':
+      config.queue_limits.max_bytes = std::stoul(optarg);
+      break;
+    case 'o':
+      if (!parse_policy(optarg, config.queue_limits.policy)) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'p':
+      config.pool_threads = std::stoi(optarg); // sessions on a fixed thread pool
+      break;
+    case 'P':
+      config.queue_limits.spill_dir = optarg;
+      break;
+    case 'r':
+      config.room_owners = std::stoi(optarg); // broadcasts run by per-room threads
+      break;
+    case 'R':
+      config.room_retain = std::stoul(optarg); // numbered deliveries kept for resume
+      break;
+    case 's':
+      config.stats_interval = std::stoi(optarg);
+      break;
+    case 'S':
+      config.history.segment_bytes = std::stoul(optarg) << 20;
+      break;
+    case 'T':
+      config.history.retain_secs = std::stol(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (!low_set) {
+    config.flow.low_water = config.flow.high_water / 2;
+  }
+  if (config.flow.low_water > config.flow.high_water) {
+    usage();
+    return 1;
+  }
+
+  // durability needs a history, and posted broadcasts (-r) don't
+  // tell the sender which commit they'll be in
+  if (config.history.durability != HistoryConfig::BUFFERED
+      && (config.history.dir.empty() || config.room_owners > 0)) {
+    usage();
+    return 1;
+  }
+
+  // the pool runs the threaded mode's sessions, the event loops have
+  // none for it to run
+  if (config.pool_threads > 0 && config.event_threads > 0) {
+    usage();
+    return 1;
+  }
+
+  // a log room's entries are shared by every member, so there are no
+  // stamped ones to keep
+  if (config.room_log > 0 && config.room_retain > 0) {
+    usage();
+    return 1;
+  }
+
+  if (argc - optind != 1) {
+    usage();
     return 1;
   }
 
-  int port = std::stoi(argv[1]);
+  int port = std::stoi(argv[optind]);
 
   // ignore SIGPIPE: when the server sends data to the receive client,
   // it may find that the connection has been terminated (e.g., if the
   // receive client exited)
   signal(SIGPIPE, SIG_IGN);
 
-  Server server(port);
+  Server server(port, config);
   if (!server.listen()) {
     std::cerr << "Could not listen on port " << port << "\n";
     return 1;
@@ -2,15 +2,43 @@
 #define USER_H
 
 #include <string>
+#include <cstdint>
+#include "intern.h"
 #include "message_queue.h"
 
 struct User {
   std::string username;
+  // username's ID in InternTable::global(), given when the user first
+  // joins a room as a sender (InternTable::NO_ID until then)
+  uint32_t id;
 
   // queue of pending messages awaiting delivery
   MessageQueue mqueue;
 
-  User(const std::string &username) : username(username) { }
+  // how deliveries are encoded for this user (text lines, binary
+  // frames after brlogin, binary frames with IDs after irlogin);
+  // fixed before the user joins a room
+  enum Format { TEXT, BINARY, BINARY_IDS, NUM_FORMATS };
+  Format format;
+
+  // deliveries carry the room's sequence numbers (sjoin/resume, see
+  // Room::resume_member); also fixed before joining
+  bool stamped;
+
+  // read position in the room's log, when the room keeps one (see
+  // Room::read_log); guarded by the room's log lock
+  uint64_t log_next;
+  bool log_waiting; // on the room's list to be poked at the next append
+  size_t log_waiter_pos; // ...at this position
+
+  User(const std::string &username)
+    : username(username)
+    , id(InternTable::NO_ID)
+    , format(TEXT)
+    , stamped(false)
+    , log_next(0)
+    , log_waiting(false)
+    , log_waiter_pos(0) { }
 };
 
 #endif // USER_H
@@ -0,0 +1,111 @@
+#include "guard.h"
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(int num_threads)
+  : m_started(0)
+  , m_next(0)
+  , m_pending(0)
+  , m_tasks(0)
+  , m_steals(0)
+  , m_busy(0) {
+  pthread_mutex_init(&m_idle_lock, nullptr);
+  pthread_cond_init(&m_idle_cond, nullptr);
+  for (int i = 0; i < num_threads; i++) {
+    Worker *w = new Worker;
+    w->pool = this;
+    w->index = i;
+    pthread_mutex_init(&w->lock, nullptr);
+    m_workers.push_back(w);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  // running workers never let go of us, so only with none started
+  for (Worker *w : m_workers) {
+    pthread_mutex_destroy(&w->lock);
+    delete w;
+  }
+  pthread_cond_destroy(&m_idle_cond);
+  pthread_mutex_destroy(&m_idle_lock);
+}
+
+bool WorkerPool::start() {
+  for (Worker *w : m_workers) {
+    pthread_t tid;
+    if (pthread_create(&tid, nullptr, thread_main, w) != 0) {
+      return false;
+    }
+    pthread_detach(tid);
+    m_started++;
+  }
+  return !m_workers.empty();
+}
+
+void WorkerPool::submit(TaskFn fn, void *arg) {
+  Worker *w = m_workers[m_next.fetch_add(1) % m_workers.size()];
+  {
+    Guard g(w->lock);
+    w->tasks.push_back(Task{ fn, arg });
+  }
+
+  // counted under the idle lock so a worker can't check m_pending and
+  // go to sleep in between
+  Guard g(m_idle_lock);
+  m_pending++;
+  pthread_cond_signal(&m_idle_cond);
+}
+
+void *WorkerPool::thread_main(void *arg) {
+  Worker *w = static_cast<Worker *>(arg);
+  w->pool->run(w);
+  return nullptr;
+}
+
+void WorkerPool::run(Worker *w) {
+  while (true) {
+    {
+      Guard g(m_idle_lock);
+      while (m_pending == 0) {
+        pthread_cond_wait(&m_idle_cond, &m_idle_lock);
+      }
+      m_pending--; // ours now, take will find it in some deque
+    }
+
+    Task task;
+    while (!take(w, task)) {
+      // submit pushes before it counts, so the task we claimed is in
+      // some deque; a scan can only miss it by racing another worker
+    }
+
+    m_busy++;
+    task.fn(task.arg);
+    m_busy--;
+    m_tasks++;
+  }
+}
+
+bool WorkerPool::take(Worker *w, Task &task) {
+  {
+    Guard g(w->lock);
+    if (!w->tasks.empty()) {
+      task = w->tasks.front();
+      w->tasks.pop_front();
+      return true;
+    }
+  }
+
+  // steal the newest task of the next worker along that has one,
+  // the victim itself works from the oldest end
+  size_t n = m_workers.size();
+  for (size_t i = 1; i < n; i++) {
+    Worker *victim = m_workers[(w->index + i) % n];
+    Guard g(victim->lock);
+    if (!victim->tasks.empty()) {
+      task = victim->tasks.back();
+      victim->tasks.pop_back();
+      m_steals++;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,79 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+
+// A WorkerPool is a fixed set of threads, spawned up front, that run
+// submitted tasks. Each worker has its own deque: submit deals tasks
+// out round-robin, a worker takes from the front of its own deque and,
+// when that is empty, steals from the back of another's. So a task that
+// landed behind a long-running one (a chat session can run for hours)
+// is picked up by whichever worker frees up first.
+//
+// Tasks run to completion on one thread, so at most size() of them
+// run at once and the rest wait their turn. There is no timeout and no
+// bound on the wait: a task queued behind size() tasks that never end
+// (clients that stay connected) never runs.
+class WorkerPool {
+public:
+  typedef void (*TaskFn)(void *arg);
+
+  WorkerPool(int num_threads);
+  ~WorkerPool(); // only if no worker was started (see started)
+
+  // false if a thread couldn't be created; the ones before it are
+  // running already and, like any worker, use the pool for good
+  bool start();
+  int started() const { return m_started; }
+
+  // may be called from any thread; only queues the task, it never
+  // waits for a worker to be free
+  void submit(TaskFn fn, void *arg);
+
+  int size() const { return int(m_workers.size()); }
+
+  // counters for the stats output
+  unsigned long tasks() const { return m_tasks.load(); }
+  unsigned long steals() const { return m_steals.load(); }
+  int busy() const { return m_busy.load(); }
+
+private:
+  // value semantics prohibited
+  WorkerPool(const WorkerPool &);
+  WorkerPool &operator=(const WorkerPool &);
+
+  struct Task {
+    TaskFn fn;
+    void *arg;
+  };
+
+  // allocated one by one, so each worker's lock and deque sit apart
+  struct Worker {
+    WorkerPool *pool;
+    int index;
+    pthread_mutex_t lock;
+    std::deque<Task> tasks;
+  };
+
+  static void *thread_main(void *arg);
+  void run(Worker *w);
+  bool take(Worker *w, Task &task);
+
+  std::vector<Worker *> m_workers;
+  int m_started; // threads start has created
+  std::atomic<unsigned> m_next; // round-robin submit position
+
+  // idle workers sleep here until m_pending says there is work
+  pthread_mutex_t m_idle_lock;
+  pthread_cond_t m_idle_cond;
+  int m_pending; // submitted but not yet taken, guarded by m_idle_lock
+
+  std::atomic<unsigned long> m_tasks;
+  std::atomic<unsigned long> m_steals;
+  std::atomic<int> m_busy;
+};
+
+#endif // WORKER_POOL_H